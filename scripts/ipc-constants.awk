@@ -0,0 +1,26 @@
+# Generates a sed script which fills in the IPC constants used by
+# keyd-application-mapper from src/keyd.h.
+
+function subst(name, value) {
+	printf "s/^\\(    %s = \\).*/\\1%s/\n", name, value
+}
+
+/^#define (IPC_MAGIC|IPC_VERSION|IPC_MORE|MAX_IPC_FRAME_SIZE) / {
+	name = $2
+	sub(/IPC_/, "", name)
+	subst(name, $3)
+}
+
+/^enum ipc_type/ {
+	inenum = 1
+	n = 0
+	next
+}
+
+inenum && /^}/ {
+	inenum = 0
+}
+
+inenum && match($0, /IPC_[A-Z_]+/) {
+	subst(substr($0, RSTART + 4, RLENGTH - 4), n++)
+}
@@ -0,0 +1,246 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+
+#include "keyd.h"
+#include <stddef.h>
+#include <sys/mman.h>
+
+/*
+ * Compiled configs are stored as a header followed by a raw struct config,
+ * which contains no pointers and can consequently be mapped directly. An
+ * entry is only used if it was produced by the same build, with the same
+ * config layout, from a source with the same hash (which covers included
+ * files).
+ *
+ * Entries are replaced atomically, so existing mappings remain valid.
+ */
+
+#define CACHE_MAGIC "KEYDCFG"
+
+/*
+ * Must be bumped whenever the meaning of the compiled config changes, e.g.
+ * when fields are reordered or the OP_* and MACRO_* enums are renumbered.
+ * Release builds share a version string, so this cannot be left to it.
+ */
+#define CACHE_FORMAT_VERSION 1
+
+struct cache_header {
+	char magic[8];
+	char version[64];
+	uint32_t format;
+	uint64_t layout;
+	uint64_t config_sz;
+	uint64_t hash;
+};
+
+/*
+ * Returns a stamp of the config layout, which catches most changes that
+ * CACHE_FORMAT_VERSION has not been bumped for.
+ */
+static uint64_t layout_stamp()
+{
+	const uint64_t values[] = {
+		sizeof(struct config),
+		offsetof(struct config, layers),
+		offsetof(struct config, descriptors),
+		offsetof(struct config, macros),
+		offsetof(struct config, commands),
+		offsetof(struct config, aliases),
+		offsetof(struct config, ids),
+		offsetof(struct config, nr_layers),
+		offsetof(struct config, macro_timeout),
+		offsetof(struct config, default_layout),
+
+		sizeof(struct layer),
+		offsetof(struct layer, type),
+		offsetof(struct layer, keymap),
+		offsetof(struct layer, chords),
+		offsetof(struct layer, nr_chords),
+		offsetof(struct layer, constituents),
+
+		sizeof(struct chord),
+		offsetof(struct chord, keymask),
+		offsetof(struct chord, d),
+		sizeof(struct descriptor),
+
+		sizeof(struct macro),
+		sizeof(struct macro_entry),
+		offsetof(struct macro_entry, data),
+
+		OP_SCROLL,
+		MACRO_TIMEOUT,
+		LT_COMPOSITE,
+	};
+	uint64_t stamp = 0xcbf29ce484222325;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(values); i++) {
+		stamp ^= values[i];
+		stamp *= 0x100000001b3;
+	}
+
+	return stamp;
+}
+
+static void cache_path(char buf[PATH_MAX], const char *path)
+{
+	const char *name = strrchr(path, '/');
+
+	snprintf(buf, PATH_MAX, "%s/%s.cache", CACHE_DIR, name ? name + 1 : path);
+}
+
+static int cache_valid(const struct cache_header *hdr, const char *path, uint64_t hash)
+{
+	const struct config *config = (const struct config *)(hdr + 1);
+
+	return !strcmp(hdr->magic, CACHE_MAGIC) &&
+		!strncmp(hdr->version, VERSION, sizeof hdr->version) &&
+		hdr->format == CACHE_FORMAT_VERSION &&
+		hdr->layout == layout_stamp() &&
+		hdr->config_sz == sizeof(struct config) &&
+		hdr->hash == hash &&
+		!strcmp(config->path, path);
+}
+
+static int cache_write(const char *path, const struct cache_header *hdr)
+{
+	char cpath[PATH_MAX];
+	char tmp[PATH_MAX+8];
+	ssize_t sz = sizeof(*hdr) + hdr->config_sz;
+	int fd;
+
+	cache_path(cpath, path);
+	snprintf(tmp, sizeof tmp, "%s.tmp", cpath);
+
+	mkdir(CACHE_DIR, 0755);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		err("failed to create %.1024s: %s", tmp, strerror(errno));
+		return -1;
+	}
+
+	if (write(fd, hdr, sz) != sz || fsync(fd) < 0) {
+		err("failed to write %.1024s: %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	close(fd);
+
+	if (rename(tmp, cpath) < 0) {
+		err("failed to rename %.1024s: %s", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct cache_header *compile(const char *path)
+{
+	struct cache_header *hdr = calloc(1, sizeof(*hdr) + sizeof(struct config));
+	struct config *config = (struct config *)(hdr + 1);
+
+	if (config_parse(config, path)) {
+		free(hdr);
+		return NULL;
+	}
+
+	strcpy(hdr->magic, CACHE_MAGIC);
+	snprintf(hdr->version, sizeof hdr->version, "%s", VERSION);
+	hdr->format = CACHE_FORMAT_VERSION;
+	hdr->layout = layout_stamp();
+	hdr->config_sz = sizeof(struct config);
+	hdr->hash = config->hash;
+
+	return hdr;
+}
+
+static void *cache_map(const char *path, uint64_t hash, size_t *sz)
+{
+	char cpath[PATH_MAX];
+	struct stat st;
+	void *addr;
+	int fd;
+
+	cache_path(cpath, path);
+
+	if ((fd = open(cpath, O_RDONLY)) < 0)
+		return NULL;
+
+	*sz = sizeof(struct cache_header) + sizeof(struct config);
+
+	if (fstat(fd, &st) || (size_t)st.st_size != *sz) {
+		close(fd);
+		return NULL;
+	}
+
+	addr = mmap(NULL, *sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	if (!cache_valid(addr, path, hash)) {
+		munmap(addr, *sz);
+		return NULL;
+	}
+
+	return addr;
+}
+
+int config_image_load(struct config_image *img, const char *path)
+{
+	struct cache_header *hdr;
+	uint64_t hash;
+
+	if (!(hash = config_hash(path)))
+		return -1;
+
+	if ((img->addr = cache_map(path, hash, &img->sz))) {
+		img->config = (const struct config *)((struct cache_header *)img->addr + 1);
+		return 0;
+	}
+
+	if (!(hdr = compile(path)))
+		return -1;
+
+	if (cache_write(path, hdr))
+		keyd_log("CONFIG: y{WARNING} %s\n", errstr);
+
+	img->addr = hdr;
+	img->sz = 0;
+	img->config = (const struct config *)(hdr + 1);
+
+	return 0;
+}
+
+void config_image_free(struct config_image *img)
+{
+	if (img->sz)
+		munmap(img->addr, img->sz);
+	else
+		free(img->addr);
+
+	img->addr = NULL;
+	img->config = NULL;
+}
+
+int config_compile(const char *path)
+{
+	int ret;
+	struct cache_header *hdr;
+
+	if (!(hdr = compile(path)))
+		return -1;
+
+	ret = cache_write(path, hdr);
+	free(hdr);
+
+	return ret;
+}
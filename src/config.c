@@ -26,6 +26,7 @@
 
 #define MAX_FILE_SZ 65536
 #define MAX_LINE_LEN 256
+#define MAX_INCLUDES 32
 
 #undef warn
 #define warn(fmt, ...) keyd_log("\ty{WARNING:} "fmt"\n", ##__VA_ARGS__)
@@ -105,6 +106,10 @@ static const char *resolve_include_path(const char *path, const char *include_pa
 	return NULL;
 }
 
+/* Files included by the config most recently read with read_file(). */
+static char includes[MAX_INCLUDES][PATH_MAX];
+static size_t nr_includes;
+
 static char *read_file(const char *path)
 {
 	const char include_prefix[] = "include ";
@@ -113,6 +118,8 @@ static char *read_file(const char *path)
 	char line[MAX_LINE_LEN+1];
 	int sz = 0;
 
+	nr_includes = 0;
+
 	FILE *fh = fopen(path, "r");
 	if (!fh) {
 		err("failed to open %s", path);
@@ -153,6 +160,9 @@ static char *read_file(const char *path)
 				continue;
 			}
 
+			if (nr_includes < MAX_INCLUDES)
+				strcpy(includes[nr_includes++], resolved_path);
+
 			fd = open(resolved_path, O_RDONLY);
 
 			if (fd < 0) {
@@ -273,6 +283,12 @@ static int set_layer_entry(const struct config *config,
 			chord->sz = n;
 			chord->d = *d;
 
+			memset(chord->keymask, 0, sizeof chord->keymask);
+			for (i = 0; i < n; i++) {
+				chord->keymask[keys[i] >> 6] |= 1ULL << (keys[i] & 63);
+				layer->chord_keymask[keys[i] >> 6] |= 1ULL << (keys[i] & 63);
+			}
+
 			layer->nr_chords++;
 		}
 	} else {
@@ -311,6 +327,7 @@ static int new_layer(char *s, const struct config *config, struct layer *layer)
 	strcpy(layer->name, name);
 
 	layer->nr_chords = 0;
+	memset(layer->chord_keymask, 0, sizeof layer->chord_keymask);
 
 	if (strchr(name, '+')) {
 		char *layername;
@@ -925,6 +942,19 @@ static void config_init(struct config *config)
 	config->macro_repeat_timeout = 50;
 }
 
+/* 64 bit FNV-1a */
+static uint64_t hash_string(const char *s)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+
+	for (; *s; s++) {
+		hash ^= (uint8_t)*s;
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
 int config_parse(struct config *config, const char *path)
 {
 	char *content;
@@ -934,10 +964,32 @@ int config_parse(struct config *config, const char *path)
 
 	config_init(config);
 	snprintf(config->path, sizeof(config->path), "%s", path);
+	config->hash = hash_string(content);
+
 	return config_parse_string(config, content);
 }
 
-int config_check_match(struct config *config, uint16_t vendor, uint16_t product, uint8_t flags)
+uint64_t config_hash(const char *path)
+{
+	char *content;
+
+	if (!(content = read_file(path)))
+		return 0;
+
+	return hash_string(content);
+}
+
+size_t config_get_includes(const char *paths[])
+{
+	size_t i;
+
+	for (i = 0; i < nr_includes; i++)
+		paths[i] = includes[i];
+
+	return nr_includes;
+}
+
+int config_check_match(const struct config *config, uint16_t vendor, uint16_t product, uint8_t flags)
 {
 	size_t i;
 
@@ -72,6 +72,9 @@ struct chord {
 	uint8_t keys[8];
 	size_t sz;
 
+	/* The set of constituent keys, indexed by code. */
+	uint64_t keymask[4];
+
 	struct descriptor d;
 };
 
@@ -98,6 +101,9 @@ struct layer {
 	struct chord chords[64];
 	size_t nr_chords;
 
+	/* The union of all chord keymasks. */
+	uint64_t chord_keymask[4];
+
 	/* Used for composite layers. */
 	size_t nr_constituents;
 	int constituents[8];
@@ -109,6 +115,10 @@ struct command {
 
 struct config {
 	char path[PATH_MAX];
+
+	/* Hash of the source, including any included files. */
+	uint64_t hash;
+
 	struct layer layers[MAX_LAYERS];
 
 	/* Auxiliary descriptors used by layer bindings. */
@@ -151,6 +161,33 @@ int config_parse(struct config *config, const char *path);
 int config_add_entry(struct config *config, const char *exp);
 int config_get_layer_index(const struct config *config, const char *name);
 
-int config_check_match(struct config *config, uint16_t vendor, uint16_t product, uint8_t flags);
+uint64_t config_hash(const char *path);
+
+/*
+ * Populates paths with the files included by the config most recently
+ * read by config_parse() or config_hash() and returns their number (at
+ * most 32).
+ */
+size_t config_get_includes(const char *paths[]);
+
+int config_check_match(const struct config *config, uint16_t vendor, uint16_t product, uint8_t flags);
+
+/*
+ * A read-only config backed by the compiled config cache in CACHE_DIR (see
+ * cache.c). Cached configs are mapped into memory, all others are parsed
+ * and written to the cache for subsequent loads.
+ */
+struct config_image {
+	const struct config *config;
+
+	void *addr;
+	size_t sz; /* The size of the mapping, or 0 if addr was allocated. */
+};
+
+int config_image_load(struct config_image *img, const char *path);
+void config_image_free(struct config_image *img);
+
+/* Unconditionally (re)compiles the given config into the cache. */
+int config_compile(const char *path);
 
 #endif
@@ -1,484 +1,1782 @@
 #include "keyd.h"
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 
 #define VKBD_NAME "keyd virtual keyboard"
 
+/* Time (in us) to wait for config changes to settle before reloading. */
+#define RELOAD_DELAY 100000
+
+#define MAX_APP_SECTIONS 64
+#define MAX_APP_SECTION_SIZE (64 * 1024)
+/* The number of compiled combinations of app sections cached for each config. */
+#define MAX_OVERLAYS 8
+
+struct overlay {
+	uint64_t mask;
+	struct config *config;
+	struct overlay *next;
+};
+
 struct config_ent {
-	struct config config;
+	struct config_image img;
 	struct keyboard *kbd;
+	/* Runs the keyboard in threaded mode. */
+	struct worker *worker;
+
+	/* Ordered by most recent use. */
+	struct overlay *overlays;
+
 	struct config_ent *next;
 };
 
+struct app_section {
+	/* class holds the allocation containing the other fields. */
+	char *class;
+	const char *title;
+	const char *bindings;
+};
+
 static int ipcfd = -1;
+static int runnerfd = -1;
+static int workerfd = -1;
+/* Run each keyboard on a thread of its own (see worker.h). */
+static int threaded = 0;
 static struct vkbd *vkbd = NULL;
 static struct config_ent *configs;
 
+/* The keyboard which requested the pending main loop timeout. */
+static struct keyboard *timeout_kbd = NULL;
+
 static uint8_t keystate[256];
 
-static int listeners[32];
-static size_t nr_listeners = 0;
+static struct app_section app_sections[MAX_APP_SECTIONS];
+static size_t nr_app_sections = 0;
+/* The sections matching the focused application. */
+static uint64_t app_mask = 0;
+
+/* Watches CONFIG_DIR and any included files for changes. */
+static int cfgmon = -1;
+static int64_t reload_deadline = 0;
+
+/*
+ * Automatic reloads load changed config files on a thread of their own
+ * (see start_reload()), which signals reloadfd once it is done. The config
+ * parser is not reentrant, so any use of it is guarded by config_lock.
+ */
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t reload_tid;
+static int reloadfd = -1;
+static int reload_running = 0;
+/* Another change was detected while a reload was running. */
+static int reload_again = 0;
+
+/* A .conf file in CONFIG_DIR. */
+struct config_file {
+	char path[PATH_MAX];
+	uint64_t hash;
+
+	/* Set if img holds the loaded config (only new or changed files are loaded). */
+	int loaded;
+	struct config_image img;
+
+	struct config_file *next;
+};
+
+/* Files known at the start of the current background reload, and its result. */
+static struct config_file *reload_known;
+static struct config_file *reload_files;
+
+/*
+ * IPC clients are serviced incrementally from the event loop. Requests which
+ * take time to complete (input and macros) are queued and played back one at
+ * a time, and the client only receives its reply once playback has finished.
+ *
+ * Input is typed as each of its frames arrives. The connection is not read
+ * while one of its jobs is pending, so clients streaming large amounts of
+ * text are subject to back pressure.
+ */
+struct connection {
+	int fd;
+
+	/* The frame being read, and the number of bytes of it received so far. */
+	struct ipc_header hdr;
+	size_t hdr_sz;
+	size_t body_sz;
+
+	/*
+	 * The (NUL terminated) body of the current request, which may be
+	 * preceded by an incomplete character carried over from the last
+	 * input frame.
+	 */
+	char data[MAX_IPC_MESSAGE_SIZE+5];
+	size_t sz;
+
+	uint8_t type;
+	uint32_t timeout;
+
+	/* Further frames belong to the current request. */
+	int in_request;
+	/* The current request has failed and its remaining frames are discarded. */
+	int failed;
+	/* A job is pending on behalf of the connection. */
+	int busy;
+	/* A reply could not be delivered. */
+	int broken;
+
+	struct macro macro;
+	/* Offset of the next character to be typed by an input request. */
+	size_t input_pos;
+	/* The application section received so far by an IPC_APP_ADD request. */
+	char *section;
+	size_t section_sz;
+	/* Characters typed since the current input frame was started (and when). */
+	size_t input_count;
+	int64_t input_start;
+
+	struct connection *next;
+	struct connection *next_job;
+};
+
+static struct connection *connections;
+static struct connection *jobs;
+static int64_t job_deadline = 0;
+
+static struct macro_player macro_player;
+static struct input_state input_state;
+
+/*
+ * Per-application bindings (see keyd-application-mapper(1)). Each section
+ * applies a set of bindings to windows whose class and title match its
+ * patterns. The config resulting from each combination of matching sections
+ * is compiled on first use and cached, so switching between applications is
+ * usually just a matter of swapping config pointers.
+ */
+static void free_overlays(struct config_ent *ent)
+{
+	while (ent->overlays) {
+		struct overlay *tmp = ent->overlays;
+		ent->overlays = tmp->next;
+
+		free(tmp->config);
+		free(tmp);
+	}
+}
 
-static void free_configs()
+static int add_app_bindings(struct config *config, const char *bindings)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&config_lock);
+
+	while (*bindings) {
+		char exp[MAX_IPC_MESSAGE_SIZE];
+		size_t len = strcspn(bindings, "\n");
+
+		snprintf(exp, sizeof exp, "%.*s", (int)len, bindings);
+		bindings += len + (bindings[len] == '\n');
+
+		if (exp[0] && config_add_entry(config, exp) < 0)
+			ret = -1;
+	}
+
+	pthread_mutex_unlock(&config_lock);
+
+	return ret;
+}
+
+/* Returns the config for the given combination of app sections. */
+static const struct config *lookup_overlay(struct config_ent *ent, uint64_t mask)
+{
+	struct overlay **prev;
+	struct overlay *ov;
+	size_t i, n = 0;
+
+	if (!mask)
+		return ent->img.config;
+
+	for (prev = &ent->overlays; *prev; prev = &(*prev)->next) {
+		if ((*prev)->mask == mask) {
+			ov = *prev;
+
+			/* Move to the front. */
+			*prev = ov->next;
+			ov->next = ent->overlays;
+			ent->overlays = ov;
+
+			return ov->config;
+		}
+	}
+
+	ov = malloc(sizeof *ov);
+	ov->mask = mask;
+	ov->config = malloc(sizeof(struct config));
+	memcpy(ov->config, ent->img.config, sizeof(struct config));
+
+	for (i = 0; i < nr_app_sections; i++)
+		if (mask & ((uint64_t)1 << i))
+			add_app_bindings(ov->config, app_sections[i].bindings);
+
+	ov->next = ent->overlays;
+	ent->overlays = ov;
+
+	/* Evict the least recently used overlay. */
+	for (prev = &ent->overlays; *prev; prev = &(*prev)->next) {
+		if (++n > MAX_OVERLAYS) {
+			struct overlay *tmp = *prev;
+
+			*prev = NULL;
+			free(tmp->config);
+			free(tmp);
+			break;
+		}
+	}
+
+	return ov->config;
+}
+
+/* Gives the event loop exclusive access to keyboards run by workers. */
+static void lock_keyboards()
+{
+	struct config_ent *ent;
+
+	for (ent = configs; ent; ent = ent->next)
+		if (ent->worker)
+			worker_lock(ent->worker);
+}
+
+static void unlock_keyboards()
+{
+	struct config_ent *ent;
+
+	for (ent = configs; ent; ent = ent->next)
+		if (ent->worker)
+			worker_unlock(ent->worker);
+}
+
+static struct worker *lookup_worker(const struct keyboard *kbd)
+{
+	struct config_ent *ent;
+
+	for (ent = configs; ent; ent = ent->next)
+		if (ent->kbd == kbd)
+			return ent->worker;
+
+	return NULL;
+}
+
+static void apply_app_overlays()
+{
+	struct config_ent *ent;
+
+	lock_keyboards();
+
+	for (ent = configs; ent; ent = ent->next) {
+		const struct config *config = lookup_overlay(ent, app_mask);
+
+		if (ent->kbd->original_config != config)
+			kbd_set_base_config(ent->kbd, config);
+	}
+
+	unlock_keyboards();
+}
+
+static void clear_app_sections()
+{
+	size_t i;
+	struct config_ent *ent;
+
+	app_mask = 0;
+	apply_app_overlays();
+
+	for (ent = configs; ent; ent = ent->next)
+		free_overlays(ent);
+
+	for (i = 0; i < nr_app_sections; i++)
+		free(app_sections[i].class);
+
+	nr_app_sections = 0;
+}
+
+/*
+ * Adds a section of the form "<class>[|<title>]" followed by a newline
+ * separated list of bindings, which must apply to at least one config.
+ */
+static int add_app_section(const char *data)
+{
+	struct app_section *section;
+	struct config_ent *ent;
+	struct config *scratch;
+	char *s;
+	int valid;
+
+	if (nr_app_sections == MAX_APP_SECTIONS) {
+		err("maximum number of application sections exceeded");
+		return -1;
+	}
+
+	scratch = malloc(sizeof(struct config));
+	s = strdup(data);
+
+	section = &app_sections[nr_app_sections];
+	section->class = s;
+	section->title = "*";
+	section->bindings = "";
+
+	if ((s = strchr(s, '\n'))) {
+		*s = 0;
+		section->bindings = s + 1;
+	}
+
+	if ((s = strchr(section->class, '|'))) {
+		*s = 0;
+		section->title = s + 1;
+	}
+
+	/* Report bindings which don't apply to any config. */
+	valid = !configs;
+	for (ent = configs; ent; ent = ent->next) {
+		memcpy(scratch, ent->img.config, sizeof(struct config));
+
+		if (!add_app_bindings(scratch, section->bindings))
+			valid = 1;
+	}
+
+	free(scratch);
+
+	if (!valid) {
+		free(section->class);
+		return -1;
+	}
+
+	nr_app_sections++;
+	return 0;
+}
+
+/* Activates the bindings of all sections matching the supplied "<class>|<title>". */
+static void set_app_focus(char *class)
+{
+	const char *title = "";
+	char *s = strchr(class, '|');
+	uint64_t mask = 0;
+	size_t i;
+
+	if (s) {
+		*s = 0;
+		title = s + 1;
+	}
+
+	for (i = 0; i < nr_app_sections; i++)
+		if (!fnmatch(app_sections[i].class, class, 0) &&
+		    !fnmatch(app_sections[i].title, title, 0))
+			mask |= (uint64_t)1 << i;
+
+	if (mask != app_mask) {
+		app_mask = mask;
+		apply_app_overlays();
+	}
+}
+
+static void free_configs(struct config_ent *ent)
 {
-	struct config_ent *ent = configs;
 	while (ent) {
 		struct config_ent *tmp = ent;
 		ent = ent->next;
-		free(tmp->kbd);
+
+		if (tmp->kbd == timeout_kbd)
+			timeout_kbd = NULL;
+
+		if (tmp->worker)
+			worker_stop(tmp->worker);
+
+		free_keyboard(tmp->kbd);
+		free_overlays(tmp);
+		config_image_free(&tmp->img);
 		free(tmp);
 	}
-
-	configs = NULL;
 }
 
 static void cleanup()
 {
-	free_configs();
+	free_configs(configs);
+	configs = NULL;
+
 	free_vkbd(vkbd);
 }
 
-static void clear_vkbd()
+/*
+ * Output generated by a keyboard run by a worker is passed back to the event
+ * loop, which performs it with perform_output().
+ */
+static void send_key(uint8_t code, uint8_t state)
+{
+	if (worker_emit(&(struct worker_output) { .type = OUTPUT_KEY, .code = code, .state = state }))
+		return;
+
+	keystate[code] = state;
+	vkbd_send_key(vkbd, code, state);
+}
+
+static void run_command(const char *cmd)
+{
+	if (worker_emit(&(struct worker_output) { .type = OUTPUT_COMMAND, .name = cmd }))
+		return;
+
+	runner_exec(cmd);
+}
+
+static void mouse_move(int x, int y)
+{
+	if (worker_emit(&(struct worker_output) { .type = OUTPUT_MOUSE_MOVE, .x = x, .y = y }))
+		return;
+
+	vkbd_mouse_move(vkbd, x, y);
+}
+
+static void mouse_move_abs(int x, int y)
+{
+	if (worker_emit(&(struct worker_output) { .type = OUTPUT_MOUSE_MOVE_ABS, .x = x, .y = y }))
+		return;
+
+	vkbd_mouse_move_abs(vkbd, x, y);
+}
+
+static void mouse_scroll(int x, int y)
+{
+	if (worker_emit(&(struct worker_output) { .type = OUTPUT_MOUSE_SCROLL, .x = x, .y = y }))
+		return;
+
+	vkbd_mouse_scroll(vkbd, x, y);
+}
+
+/*
+ * Layer changes are queued for each listener and written out by
+ * flush_listeners() once the triggering event has been fully processed, with
+ * any remainder being written as the socket becomes writable. This keeps slow
+ * listeners off the input path. A change which is immediately reverted
+ * before being written is dropped, and if the queue overflows the oldest
+ * changes are discarded (which can be detected by listeners that have
+ * requested sequence numbers).
+ */
+
+#define LISTENER_QUEUE_SIZE 64
+
+struct listener {
+	int fd;
+	int seq;
+
+	struct {
+		uint32_t seq;
+		uint8_t state;
+		char name[MAX_LAYER_NAME_LEN+1];
+	} queue[LISTENER_QUEUE_SIZE];
+
+	size_t head;
+	size_t sz;
+	uint32_t next_seq;
+
+	/* Number of bytes of the change at the head of the queue already written. */
+	size_t off;
+	/* Waiting for the socket to become writable. */
+	int blocked;
+
+	struct listener *next;
+};
+
+static struct listener *listeners;
+
+static void add_listener(int con, int seq)
+{
+	struct listener *l;
+
+	if (evloop_add_fd(con) < 0) {
+		char s[] = "Max listeners exceeded\n";
+
+		if (write(con, &s, sizeof s) < 0)
+			dbg("failed to notify listener: %s", strerror(errno));
+
+		close(con);
+		return;
+	}
+
+	l = calloc(1, sizeof *l);
+	l->fd = con;
+	l->seq = seq;
+	l->next = listeners;
+
+	listeners = l;
+}
+
+static void remove_listener(struct listener *l)
+{
+	struct listener **ent;
+
+	for (ent = &listeners; *ent != l; ent = &(*ent)->next)
+		;
+
+	*ent = l->next;
+
+	evloop_remove_fd(l->fd);
+	close(l->fd);
+	free(l);
+}
+
+static struct listener *lookup_listener(int fd)
+{
+	struct listener *l;
+
+	for (l = listeners; l; l = l->next)
+		if (l->fd == fd)
+			return l;
+
+	return NULL;
+}
+
+static void queue_layer_change(struct listener *l, const char *name, uint8_t state)
+{
+	size_t idx;
+
+	if (l->sz && (l->sz > 1 || !l->off)) {
+		idx = (l->head + l->sz - 1) % LISTENER_QUEUE_SIZE;
+
+		if (l->queue[idx].state != state && !strcmp(l->queue[idx].name, name)) {
+			l->sz--;
+			l->next_seq--;
+			return;
+		}
+	}
+
+	if (l->sz == LISTENER_QUEUE_SIZE) {
+		size_t next = (l->head + 1) % LISTENER_QUEUE_SIZE;
+
+		/* Preserve a partially written change. */
+		if (l->off)
+			l->queue[next] = l->queue[l->head];
+
+		l->head = next;
+		l->sz--;
+	}
+
+	idx = (l->head + l->sz) % LISTENER_QUEUE_SIZE;
+
+	l->queue[idx].seq = l->next_seq++;
+	l->queue[idx].state = state;
+	snprintf(l->queue[idx].name, sizeof l->queue[idx].name, "%s", name);
+
+	l->sz++;
+}
+
+/* Returns -1 if the listener has gone away. */
+static int flush_listener(struct listener *l)
+{
+	char buf[4096];
+	size_t lens[LISTENER_QUEUE_SIZE];
+	size_t i, n = 0;
+	size_t sz = 0;
+	ssize_t nw;
+
+	for (i = 0; i < l->sz; i++) {
+		size_t idx = (l->head + i) % LISTENER_QUEUE_SIZE;
+		int len;
+
+		if (sizeof buf - sz < MAX_LAYER_NAME_LEN + 16)
+			break;
+
+		if (l->seq)
+			len = sprintf(buf + sz, "%u %c%s\n", l->queue[idx].seq,
+				      l->queue[idx].state ? '+' : '-', l->queue[idx].name);
+		else
+			len = sprintf(buf + sz, "%c%s\n",
+				      l->queue[idx].state ? '+' : '-', l->queue[idx].name);
+
+		lens[n++] = len;
+		sz += len;
+	}
+
+	nw = sz ? write(l->fd, buf + l->off, sz - l->off) : 0;
+
+	if (nw < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		nw = 0;
+	else if (nw < 0)
+		return -1;
+
+	nw += l->off;
+
+	for (i = 0; i < n && (size_t)nw >= lens[i]; i++) {
+		nw -= lens[i];
+
+		l->head = (l->head + 1) % LISTENER_QUEUE_SIZE;
+		l->sz--;
+	}
+
+	l->off = nw;
+
+	if (l->blocked != (l->sz != 0)) {
+		l->blocked = l->sz != 0;
+		evloop_watch_output(l->fd, l->blocked);
+	}
+
+	return 0;
+}
+
+static void flush_listeners()
+{
+	struct listener *l = listeners;
+
+	while (l) {
+		struct listener *next = l->next;
+
+		if ((l->sz || l->blocked) && flush_listener(l) < 0)
+			remove_listener(l);
+
+		l = next;
+	}
+}
+
+/* Handles activity on a listener socket, returns -1 if it has gone away. */
+static int service_listener(struct listener *l)
+{
+	char buf[64];
+	ssize_t n;
+
+	/* Listeners aren't expected to send anything, so this can only be a hangup. */
+	while ((n = read(l->fd, buf, sizeof buf)) > 0)
+		;
+
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ||
+	    flush_listener(l) < 0) {
+		remove_listener(l);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void on_layer_change(const struct keyboard *kbd, const char *name, uint8_t state)
 {
 	size_t i;
+	struct listener *l;
+
+	if (worker_emit(&(struct worker_output) {
+		.type = OUTPUT_LAYER,
+		.kbd = kbd,
+		.name = name,
+		.state = state,
+	}))
+		return;
 
-	for (i = 0; i < 256; i++)
-		if (keystate[i]) {
-			vkbd_send_key(vkbd, i, 0);
-			keystate[i] = 0;
+	if (kbd->config->layer_indicator) {
+		for (i = 0; i < device_table_sz; i++)
+			if (device_table[i].data == kbd)
+				device_set_led(&device_table[i], 1, state);
+	}
+
+	for (l = listeners; l; l = l->next)
+		queue_layer_change(l, name, state);
+}
+
+static void perform_output(const struct worker_output *out)
+{
+	switch (out->type) {
+	case OUTPUT_KEY:
+		send_key(out->code, out->state);
+		break;
+	case OUTPUT_LAYER:
+		on_layer_change(out->kbd, out->name, out->state);
+		break;
+	case OUTPUT_COMMAND:
+		run_command(out->name);
+		break;
+	case OUTPUT_MOUSE_MOVE:
+		mouse_move(out->x, out->y);
+		break;
+	case OUTPUT_MOUSE_MOVE_ABS:
+		mouse_move_abs(out->x, out->y);
+		break;
+	case OUTPUT_MOUSE_SCROLL:
+		mouse_scroll(out->x, out->y);
+		break;
+	}
+}
+
+/*
+ * Key events carry the time at which the kernel received them, which may
+ * precede the time at which a timeout has already been delivered to the
+ * keyboard. Time is never allowed to run backwards.
+ */
+static int64_t kbd_time(int64_t *time, int64_t timestamp)
+{
+	if (timestamp > *time)
+		*time = timestamp;
+
+	return *time;
+}
+
+/*
+ * Passes the events read from a device to its keyboard (see worker_fn).
+ * Consecutive key events are passed as a single batch, which is flushed
+ * before any intervening mouse event to preserve ordering.
+ */
+static int64_t process_device_events(struct keyboard *kbd,
+				     const struct device_event *devevs, size_t n,
+				     int64_t *time)
+{
+	struct key_event kevs[MAX_DEVICE_EVENTS];
+	struct key_event kev = {0};
+	int64_t timeout = -1;
+	size_t nkevs = 0;
+	size_t i;
+
+	for (i = 0; i <= n; i++) {
+		const struct device_event *devev = &devevs[i];
+
+		if (i < n && devev->type == DEV_KEY) {
+			dbg("input %s %s", KEY_NAME(devev->code), devev->pressed ? "down" : "up");
+
+			kevs[nkevs].code = devev->code;
+			kevs[nkevs].pressed = devev->pressed;
+			kevs[nkevs].timestamp = kbd_time(time, devev->timestamp);
+			nkevs++;
+
+			continue;
 		}
+
+		if (nkevs) {
+			timeout = kbd_process_events(kbd, kevs, nkevs);
+			nkevs = 0;
+		}
+
+		if (i == n)
+			break;
+
+		switch (devev->type) {
+		case DEV_MOUSE_MOVE:
+			if (kbd->scroll.active) {
+				if (kbd->scroll.sensitivity == 0)
+					break;
+				int xticks, yticks;
+
+				kbd->scroll.y += devev->y;
+				kbd->scroll.x += devev->x;
+
+				yticks = kbd->scroll.y / kbd->scroll.sensitivity;
+				kbd->scroll.y %= kbd->scroll.sensitivity;
+
+				xticks = kbd->scroll.x / kbd->scroll.sensitivity;
+				kbd->scroll.x %= kbd->scroll.sensitivity;
+
+				mouse_scroll(0, -1*yticks);
+				mouse_scroll(0, xticks);
+			} else {
+				mouse_move(devev->x, devev->y);
+			}
+			break;
+		case DEV_MOUSE_MOVE_ABS:
+			mouse_move_abs(devev->x, devev->y);
+			break;
+		default:
+			break;
+		case DEV_MOUSE_SCROLL:
+			/*
+			 * Treat scroll events as mouse buttons so oneshot and the like get
+			 * cleared.
+			 */
+			kev.code = KEYD_EXTERNAL_MOUSE_BUTTON;
+			kev.pressed = 1;
+			kev.timestamp = kbd_time(time, devev->timestamp);
+
+			kbd_process_events(kbd, &kev, 1);
+
+			kev.pressed = 0;
+			timeout = kbd_process_events(kbd, &kev, 1);
+
+			mouse_scroll(devev->x, devev->y);
+			break;
+		}
+	}
+
+	return timeout;
 }
 
-static void send_key(uint8_t code, uint8_t state)
+
+static void watch_includes()
 {
-	keystate[code] = state;
-	vkbd_send_key(vkbd, code, state);
+	size_t i, n;
+	const char *paths[32];
+
+	if (cfgmon == -1)
+		return;
+
+	/* Files may have been replaced, so watches are (re)added on each read. */
+	n = config_get_includes(paths);
+	for (i = 0; i < n; i++)
+		inotify_add_watch(cfgmon, paths[i],
+				  IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+}
+
+static void cfgmon_init()
+{
+	cfgmon = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (cfgmon < 0) {
+		perror("inotify");
+		exit(-1);
+	}
+
+	/* IN_CREATE covers configs which are added as symlinks. */
+	if (inotify_add_watch(cfgmon, CONFIG_DIR,
+			      IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+		keyd_log("CONFIG: y{WARNING} failed to watch %s: %s\n", CONFIG_DIR, strerror(errno));
+		close(cfgmon);
+		cfgmon = -1;
+		return;
+	}
+
+	evloop_add_fd(cfgmon);
+}
+
+/*
+ * Drains pending inotify events and returns 1 if any of them concern a
+ * config file or a potential include.
+ */
+static int cfgmon_read()
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	int changed = 0;
+
+	while ((n = read(cfgmon, buf, sizeof buf)) > 0) {
+		char *ptr = buf;
+
+		while (ptr < buf + n) {
+			struct inotify_event *ev = (struct inotify_event *)ptr;
+			size_t len = ev->len ? strlen(ev->name) : 0;
+
+			ptr += sizeof(struct inotify_event) + ev->len;
+
+			/* Events on watched include files carry no name. */
+			if (!len ||
+			    (len >= 5 && !strcmp(ev->name + len - 5, ".conf")) ||
+			    !strchr(ev->name, '.'))
+				changed = 1;
+		}
+	}
+
+	return changed;
+}
+
+static void free_config_files(struct config_file *f)
+{
+	while (f) {
+		struct config_file *tmp = f;
+		f = f->next;
+
+		if (tmp->loaded)
+			config_image_free(&tmp->img);
+
+		free(tmp);
+	}
+}
+
+/* Returns the currently loaded config files (without their configs). */
+static struct config_file *list_loaded_configs()
+{
+	struct config_ent *ent;
+	struct config_file *files = NULL;
+
+	for (ent = configs; ent; ent = ent->next) {
+		struct config_file *f = calloc(1, sizeof(struct config_file));
+
+		snprintf(f->path, sizeof f->path, "%s", ent->img.config->path);
+		f->hash = ent->img.config->hash;
+
+		f->next = files;
+		files = f;
+	}
+
+	return files;
+}
+
+static struct config_file *find_config_file(struct config_file *files, const char *path, uint64_t hash)
+{
+	for (; files; files = files->next)
+		if (hash && files->hash == hash && !strcmp(files->path, path))
+			return files;
+
+	return NULL;
+}
+
+/*
+ * Lists the config files in CONFIG_DIR, loading any which are not among
+ * known. May be called from any thread.
+ */
+static struct config_file *scan_configs(struct config_file *known)
+{
+	DIR *dh = opendir(CONFIG_DIR);
+	struct dirent *dirent;
+	struct config_file *files = NULL;
+	struct config_file **tail = &files;
+
+	if (!dh) {
+		perror("opendir");
+		exit(-1);
+	}
+
+	while ((dirent = readdir(dh))) {
+		struct config_file *f;
+		int len;
+
+		if (dirent->d_type == DT_DIR)
+			continue;
+
+		f = calloc(1, sizeof(struct config_file));
+		len = snprintf(f->path, sizeof f->path, "%s/%s", CONFIG_DIR, dirent->d_name);
+
+		if (len < 5 || strcmp(f->path + len - 5, ".conf")) {
+			free(f);
+			continue;
+		}
+
+		pthread_mutex_lock(&config_lock);
+
+		f->hash = config_hash(f->path);
+		watch_includes();
+
+		if (find_config_file(known, f->path, f->hash)) {
+			dbg("CONFIG: %s is unchanged", f->path);
+		} else {
+			keyd_log("CONFIG: loading b{%s}\n", f->path);
+
+			if (config_image_load(&f->img, f->path)) {
+				keyd_log("DEVICE: y{WARNING} failed to parse %s\n", f->path);
+				free(f);
+				f = NULL;
+			} else {
+				f->loaded = 1;
+			}
+		}
+
+		pthread_mutex_unlock(&config_lock);
+
+		if (f) {
+			*tail = f;
+			tail = &f->next;
+		}
+	}
+
+	closedir(dh);
+	return files;
+}
+
+/*
+ * Populates configs from the given files, reusing entries from old (which
+ * are removed from it) for files which have not changed. Loaded configs
+ * are taken over from files.
+ */
+static void load_configs(struct config_file *files, struct config_ent **old)
+{
+	struct output output = {
+		.send_key = send_key,
+		.on_layer_change = on_layer_change,
+		.run_command = run_command,
+	};
+	struct config_file *f;
+
+	configs = NULL;
+
+	for (f = files; f; f = f->next) {
+		struct config_ent *ent;
+		struct config_ent **prev;
+
+		if (!f->loaded) {
+			for (prev = old; *prev; prev = &(*prev)->next) {
+				const struct config *config = (*prev)->img.config;
+
+				if (config->hash == f->hash && !strcmp(config->path, f->path))
+					break;
+			}
+
+			if (*prev) {
+				ent = *prev;
+				*prev = ent->next;
+
+				ent->next = configs;
+				configs = ent;
+
+				continue;
+			}
+
+			/* The config has been replaced since the files were listed. */
+			pthread_mutex_lock(&config_lock);
+			f->loaded = !config_image_load(&f->img, f->path);
+			pthread_mutex_unlock(&config_lock);
+
+			if (!f->loaded) {
+				keyd_log("DEVICE: y{WARNING} failed to parse %s\n", f->path);
+				continue;
+			}
+		}
+
+		ent = calloc(1, sizeof(struct config_ent));
+		ent->img = f->img;
+		ent->kbd = new_keyboard(ent->img.config, &output);
+		f->loaded = 0;
+
+		ent->next = configs;
+		configs = ent;
+	}
+}
+
+static struct config_ent *lookup_config_ent(uint16_t vendor,
+					    uint16_t product,
+					    uint8_t flags)
+{
+	struct config_ent *ent = configs;
+	struct config_ent *match = NULL;
+	int rank = 0;
+
+	while (ent) {
+		int r = config_check_match(ent->img.config, vendor, product, flags);
+
+		if (r > rank) {
+			match = ent;
+			rank = r;
+		}
+
+		ent = ent->next;
+	}
+
+	/* The wildcard should not match mice. */
+	if (rank == 1 && (flags == ID_MOUSE))
+		return NULL;
+	else
+		return match;
+}
+
+static struct config_ent *lookup_device_config_ent(struct device *dev)
+{
+	uint8_t flags = 0;
+
+	if (!strcmp(dev->name, VKBD_NAME))
+		return NULL;
+
+	if (dev->capabilities & CAP_KEYBOARD)
+		flags |= ID_KEYBOARD;
+	if (dev->capabilities & (CAP_MOUSE|CAP_MOUSE_ABS))
+		flags |= ID_MOUSE;
+
+	return lookup_config_ent(dev->vendor_id, dev->product_id, flags);
+}
+
+static void manage_device(struct device *dev)
+{
+	struct config_ent *ent;
+
+	if (!strcmp(dev->name, VKBD_NAME))
+		return;
+
+	if ((ent = lookup_device_config_ent(dev))) {
+		if (device_grab(dev)) {
+			keyd_log("DEVICE: y{WARNING} Failed to grab %s\n", dev->path);
+			dev->data = NULL;
+			return;
+		}
+
+		keyd_log("DEVICE: g{match}    %04hx:%04hx  %s\t(%s)\n",
+			  dev->vendor_id, dev->product_id,
+			  ent->img.config->path,
+			  dev->name);
+
+		dev->data = ent->kbd;
+	} else {
+		dev->data = NULL;
+		device_ungrab(dev);
+		keyd_log("DEVICE: r{ignoring} %04hx:%04hx  (%s)\n", 
+			  dev->vendor_id, dev->product_id, dev->name);
+	}
+}
+
+/*
+ * Brings the loaded configs in line with the given files (see scan_configs()).
+ * Keyboards belonging to unchanged config files keep their state (and their
+ * workers), and only devices whose matching config has changed are
+ * reassigned.
+ */
+static void apply_configs(struct config_file *files)
+{
+	size_t i;
+	uint8_t held[256] = {0};
+	struct config_ent *ent;
+	struct config_ent *old = configs;
+
+	load_configs(files, &old);
+
+	/* Keyboards which are about to be freed must no longer produce output. */
+	for (ent = old; ent; ent = ent->next) {
+		if (ent->worker) {
+			worker_stop(ent->worker);
+			ent->worker = NULL;
+		}
+	}
+
+	lock_keyboards();
+
+	/* Drop any bindings applied since the last reload. */
+	for (ent = configs; ent; ent = ent->next)
+		kbd_eval(ent->kbd, "reset");
+
+	for (i = 0; i < device_table_sz; i++) {
+		struct device *dev = &device_table[i];
+
+		ent = lookup_device_config_ent(dev);
+
+		if ((ent ? ent->kbd : NULL) != dev->data)
+			manage_device(dev);
+	}
+
+	/* Release any keys which were held by removed keyboards. */
+	for (ent = configs; ent; ent = ent->next)
+		for (i = 0; i < 256; i++)
+			held[i] |= ent->kbd->keystate[i];
+
+	unlock_keyboards();
+
+	for (i = 0; i < 256; i++)
+		if (keystate[i] && !held[i])
+			send_key(i, 0);
+
+	free_configs(old);
+
+	/* Newly loaded configs start without the bindings of the focused app. */
+	apply_app_overlays();
+
+	if (threaded) {
+		for (ent = configs; ent; ent = ent->next)
+			if (!ent->worker)
+				ent->worker = worker_start(ent->kbd, process_device_events);
+	}
+}
+
+static void *reload_main(void *arg)
+{
+	uint64_t v = 1;
+
+	(void)arg;
+
+	reload_files = scan_configs(reload_known);
+
+	if (write(reloadfd, &v, sizeof v) < 0) {}
+
+	return NULL;
+}
+
+/*
+ * Loads changed config files on a separate thread, so that parsing does not
+ * hold up input. The result is applied by finish_reload() once reloadfd
+ * becomes readable.
+ */
+static void start_reload()
+{
+	pthread_attr_t attr;
+	struct sched_param param = {0};
+	sigset_t set, old;
+	int ret;
+
+	if (reload_running) {
+		reload_again = 1;
+		return;
+	}
+
+	reload_known = list_loaded_configs();
+	reload_files = NULL;
+
+	/* Don't compete with the event loop if it runs with a real-time policy. */
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &param);
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	ret = pthread_create(&reload_tid, &attr, reload_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		keyd_log("CONFIG: y{WARNING} failed to create reload thread: %s\n", strerror(ret));
+
+		free_config_files(reload_known);
+		reload_known = NULL;
+		return;
+	}
+
+	reload_running = 1;
 }
 
-static void add_listener(int con)
+/* Waits for a running background reload and applies its result. */
+static void finish_reload()
 {
-	struct timeval tv;
+	uint64_t v;
 
-	/*
-	 * In order to avoid blocking the main event loop, allow up to 50ms for
-	 * slow clients to relieve back pressure before dropping them.
-	 */
-	tv.tv_usec = 50000;
-	tv.tv_sec = 0;
+	if (!reload_running)
+		return;
 
-	if (nr_listeners == ARRAY_SIZE(listeners)) {
-		char s[] = "Max listeners exceeded\n";
-		xwrite(con, &s, sizeof s);
+	pthread_join(reload_tid, NULL);
+	if (read(reloadfd, &v, sizeof v) < 0) {}
 
-		close(con);
-		return;
-	}
+	reload_running = 0;
 
-	setsockopt(con, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	apply_configs(reload_files);
 
-	listeners[nr_listeners++] = con;
+	free_config_files(reload_files);
+	free_config_files(reload_known);
+	reload_files = NULL;
+	reload_known = NULL;
 }
 
-static void on_layer_change(const struct keyboard *kbd, const char *name, uint8_t state)
+/* Synchronously brings the loaded configs in line with CONFIG_DIR. */
+static void reload()
 {
-	size_t i;
-	char buf[MAX_LAYER_NAME_LEN+2];
-	ssize_t bufsz;
+	struct config_file *known;
+	struct config_file *files;
 
-	int keep[ARRAY_SIZE(listeners)];
-	size_t n = 0;
+	finish_reload();
+	reload_again = 0;
 
-	if (kbd->config.layer_indicator) {
-		for (i = 0; i < device_table_sz; i++)
-			if (device_table[i].data == kbd)
-				device_set_led(&device_table[i], 1, state);
-	}
+	known = list_loaded_configs();
+	files = scan_configs(known);
 
-	if (!nr_listeners)
-		return;
+	apply_configs(files);
 
-	bufsz = snprintf(buf, sizeof(buf), "%c%s\n", state ? '+' : '-', name);
-	for (i = 0; i < nr_listeners; i++) {
-		ssize_t nw = write(listeners[i], buf, bufsz);
+	free_config_files(files);
+	free_config_files(known);
+}
 
-		if (nw == bufsz)
-			keep[n++] = listeners[i];
-		else
-			close(listeners[i]);
-	}
+/* Replies are written without blocking, clients which fail to receive them are dropped. */
+static int send_reply(int fd, uint8_t type, uint32_t flags, const char *msg, size_t sz)
+{
+	char buf[sizeof(struct ipc_header) + MAX_IPC_FRAME_SIZE];
+	ssize_t n = ipc_encode(buf, type, flags, 0, msg, sz);
 
-	if (n != nr_listeners) {
-		nr_listeners = n;
-		memcpy(listeners, keep, n * sizeof(int));
-	}
+	return write(fd, buf, n) == n ? 0 : -1;
 }
 
-static void load_configs()
+static void send_success(struct connection *con)
 {
-	DIR *dh = opendir(CONFIG_DIR);
-	struct dirent *dirent;
-
-	if (!dh) {
-		perror("opendir");
-		exit(-1);
-	}
+	if (send_reply(con->fd, IPC_SUCCESS, 0, NULL, 0))
+		con->broken = 1;
+}
 
-	configs = NULL;
+static void send_fail(struct connection *con, const char *fmt, ...)
+{
+	char msg[MAX_IPC_FRAME_SIZE];
+	va_list args;
+	int sz;
 
-	while ((dirent = readdir(dh))) {
-		char path[1024];
-		int len;
+	va_start(args, fmt);
+	sz = vsnprintf(msg, sizeof msg, fmt, args);
+	va_end(args);
 
-		if (dirent->d_type == DT_DIR)
-			continue;
+	if (send_reply(con->fd, IPC_FAIL, 0, msg, sz < (int)sizeof msg ? sz : (int)sizeof msg - 1))
+		con->broken = 1;
+}
 
-		len = snprintf(path, sizeof path, "%s/%s", CONFIG_DIR, dirent->d_name);
+/*
+ * Types the text of an IPC_INPUT request, spacing characters by the requested
+ * timeout (in microseconds). Returns the time in us until the next character
+ * is due, 0 once the available text has been exhausted, or -1 on error.
+ */
+static int64_t input_step(struct connection *con, int64_t time)
+{
+	uint32_t timeout = con->timeout;
 
-		if (len >= 5 && !strcmp(path + len - 5, ".conf")) {
-			struct config_ent *ent = calloc(1, sizeof(struct config_ent));
+	if (!con->input_count)
+		con->input_start = time;
 
-			keyd_log("CONFIG: parsing b{%s}\n", path);
+	while (con->input_pos < con->sz) {
+		int n;
 
-			if (!config_parse(&ent->config, path)) {
-				struct output output = {
-					.send_key = send_key,
-					.on_layer_change = on_layer_change,
-				};
-				ent->kbd = new_keyboard(&ent->config, &output);
+		if (timeout) {
+			int64_t due = con->input_start + (int64_t)con->input_count * timeout;
 
-				ent->next = configs;
-				configs = ent;
-			} else {
-				free(ent);
-				keyd_log("DEVICE: y{WARNING} failed to parse %s\n", path);
+			if (due > time) {
+				input_release(&input_state, send_key);
+				return due - time;
 			}
-
 		}
-	}
 
-	closedir(dh);
-}
+		n = input_char(&input_state, con->data + con->input_pos,
+			       con->sz - con->input_pos, send_key);
 
-static struct config_ent *lookup_config_ent(uint16_t vendor,
-					    uint16_t product,
-					    uint8_t flags)
-{
-	struct config_ent *ent = configs;
-	struct config_ent *match = NULL;
-	int rank = 0;
+		/* Completed by the next frame. */
+		if (n == 0 && con->in_request)
+			break;
 
-	while (ent) {
-		int r = config_check_match(&ent->config, vendor, product, flags);
+		if (n == 0)
+			err("ERROR: incomplete UTF-8 sequence");
 
-		if (r > rank) {
-			match = ent;
-			rank = r;
+		if (n <= 0) {
+			input_release(&input_state, send_key);
+			return -1;
 		}
 
-		ent = ent->next;
+		con->input_pos += n;
+		con->input_count++;
 	}
 
-	/* The wildcard should not match mice. */
-	if (rank == 1 && (flags == ID_MOUSE))
-		return NULL;
-	else
-		return match;
+	input_release(&input_state, send_key);
+	return 0;
 }
 
-static void manage_device(struct device *dev)
+static struct connection *lookup_connection(int fd)
 {
-	uint8_t flags = 0;
-	struct config_ent *ent;
-
-	if (!strcmp(dev->name, VKBD_NAME))
-		return;
-
-	if (dev->capabilities & CAP_KEYBOARD)
-		flags |= ID_KEYBOARD;
-	if (dev->capabilities & (CAP_MOUSE|CAP_MOUSE_ABS))
-		flags |= ID_MOUSE;
-
-	if ((ent = lookup_config_ent(dev->vendor_id, dev->product_id, flags))) {
-		if (device_grab(dev)) {
-			keyd_log("DEVICE: y{WARNING} Failed to grab %s\n", dev->path);
-			dev->data = NULL;
-			return;
-		}
+	struct connection *con;
 
-		keyd_log("DEVICE: g{match}    %04hx:%04hx  %s\t(%s)\n",
-			  dev->vendor_id, dev->product_id,
-			  ent->config.path,
-			  dev->name);
+	for (con = connections; con; con = con->next)
+		if (con->fd == fd)
+			return con;
 
-		dev->data = ent->kbd;
-	} else {
-		dev->data = NULL;
-		device_ungrab(dev);
-		keyd_log("DEVICE: r{ignoring} %04hx:%04hx  (%s)\n", 
-			  dev->vendor_id, dev->product_id, dev->name);
-	}
+	return NULL;
 }
 
-static void reload()
+/* Removes a connection from the list and stops monitoring it. */
+static void detach_connection(struct connection *con)
 {
-	size_t i;
+	struct connection **ent;
 
-	free_configs();
-	load_configs();
+	for (ent = &connections; *ent != con; ent = &(*ent)->next)
+		;
 
-	for (i = 0; i < device_table_sz; i++)
-		manage_device(&device_table[i]);
+	*ent = con->next;
+	evloop_remove_fd(con->fd);
+}
 
-	clear_vkbd();
+static void close_connection(struct connection *con)
+{
+	detach_connection(con);
+	close(con->fd);
+	free(con->section);
+	free(con);
 }
 
-static void send_success(int con)
+/* Reports the outcome of a job and resumes reading from its connection. */
+static void finish_job(struct connection *con, int failed)
 {
-	struct ipc_message msg = {0};
+	if (failed) {
+		send_fail(con, "%s", errstr);
+
+		con->failed = con->in_request;
+		con->sz = 0;
+	} else if (con->in_request) {
+		/* Carry any incomplete character over to the next frame. */
+		con->sz -= con->input_pos;
+		memmove(con->data, con->data + con->input_pos, con->sz);
+	} else {
+		send_success(con);
+		con->sz = 0;
+	}
 
-	msg.type = IPC_SUCCESS;;
-	msg.sz = 0;
+	con->input_pos = 0;
+	con->input_count = 0;
+	con->busy = 0;
 
-	xwrite(con, &msg, sizeof msg);
-	close(con);
+	if (con->broken || evloop_add_fd(con->fd) < 0)
+		close_connection(con);
 }
 
-static void send_fail(int con, const char *fmt, ...)
+/*
+ * Advances the queued jobs until one of them needs to pause, notifying each
+ * client once its request has completed.
+ */
+static void run_jobs(int64_t time)
 {
-	struct ipc_message msg = {0};
-	va_list args;
+	while (jobs && time >= job_deadline) {
+		struct connection *con = jobs;
+		int64_t timeout;
 
-	va_start(args, fmt);
+		if (con->type == IPC_MACRO)
+			timeout = macro_step(&macro_player, send_key);
+		else
+			timeout = input_step(con, time);
 
-	msg.type = IPC_FAIL;
-	msg.sz = vsnprintf(msg.data, sizeof(msg.data), fmt, args);
+		if (timeout > 0) {
+			job_deadline = time + timeout;
+			return;
+		}
 
-	xwrite(con, &msg, sizeof msg);
-	close(con);
+		job_deadline = 0;
+		jobs = con->next_job;
 
-	va_end(args);
+		if (jobs && jobs->type == IPC_MACRO)
+			macro_start(&macro_player, &jobs->macro, jobs->timeout);
+
+		finish_job(con, timeout < 0);
+	}
 }
 
-static int input(char *buf, size_t sz, uint32_t timeout)
+/* Queues a job to be started by the next call to run_jobs(). */
+static void enqueue_job(struct connection *con)
 {
-	size_t i;
-	uint32_t codepoint;
-	uint8_t codes[4];
-
-	int csz;
-
-	while ((csz = utf8_read_char(buf, &codepoint))) {
-		int found = 0;
-		char s[2];
-
-		if (csz == 1) {
-			uint8_t code, mods;
-			s[0] = (char)codepoint;
-			s[1] = 0;
-
-			found = 1;
-			if (!parse_key_sequence(s, &code, &mods)) {
-				if (mods & MOD_SHIFT) {
-					vkbd_send_key(vkbd, KEYD_LEFTSHIFT, 1);
-					vkbd_send_key(vkbd, code, 1);
-					vkbd_send_key(vkbd, code, 0);
-					vkbd_send_key(vkbd, KEYD_LEFTSHIFT, 0);
-				} else {
-					vkbd_send_key(vkbd, code, 1);
-					vkbd_send_key(vkbd, code, 0);
-				}
-			} else if ((char)codepoint == ' ') {
-				vkbd_send_key(vkbd, KEYD_SPACE, 1);
-				vkbd_send_key(vkbd, KEYD_SPACE, 0);
-			} else if ((char)codepoint == '\n') {
-				vkbd_send_key(vkbd, KEYD_ENTER, 1);
-				vkbd_send_key(vkbd, KEYD_ENTER, 0);
-			} else if ((char)codepoint == '\t') {
-				vkbd_send_key(vkbd, KEYD_TAB, 1);
-				vkbd_send_key(vkbd, KEYD_TAB, 0);
-			} else {
-				found = 0;
-			}
-		}
+	struct connection **ent = &jobs;
 
-		if (!found) {
-			int idx = unicode_lookup_index(codepoint);
-			if (idx < 0) {
-				err("ERROR: could not find code for \"%.*s\"", csz, buf);
-				return -1;
-			}
+	while (*ent)
+		ent = &(*ent)->next_job;
 
-			unicode_get_sequence(idx, codes);
+	con->next_job = NULL;
+	*ent = con;
 
-			for (i = 0; i < 4; i++) {
-				vkbd_send_key(vkbd, codes[i], 1);
-				vkbd_send_key(vkbd, codes[i], 0);
-			}
-		}
-		buf+=csz;
+	con->busy = 1;
+	evloop_remove_fd(con->fd);
 
-		if (timeout)
-			usleep(timeout);
-	}
+	if (jobs == con) {
+		job_deadline = 0;
 
-	return 0;
+		if (con->type == IPC_MACRO)
+			macro_start(&macro_player, &con->macro, con->timeout);
+	}
 }
 
-static void handle_client(int con)
+/*
+ * Handles `keyd trace` requests, which consist of one of: on, off, reset,
+ * an empty string (summary) or "dump <seq>". Dumps are paginated: each reply
+ * holds as many records starting at <seq> as fit in a frame and carries
+ * IPC_MORE if further records remain.
+ */
+static void handle_trace(struct connection *con)
 {
-	struct ipc_message msg;
+	char buf[MAX_IPC_FRAME_SIZE];
+	unsigned long long seq;
+	uint64_t head;
+	size_t sz;
 
-	xread(con, &msg, sizeof msg);
+	if (!strcmp(con->data, "on")) {
+		trace_enable(1);
+		send_success(con);
+	} else if (!strcmp(con->data, "off")) {
+		trace_enable(0);
+		send_success(con);
+	} else if (!strcmp(con->data, "reset")) {
+		trace_reset();
+		send_success(con);
+	} else if (!con->data[0]) {
+		sz = trace_summary(buf, sizeof buf);
 
-	if (msg.sz >= sizeof(msg.data)) {
-		send_fail(con, "maximum message size exceeded");
-		return;
-	}
-	msg.data[msg.sz] = 0;
+		if (send_reply(con->fd, IPC_SUCCESS, 0, buf, sz))
+			con->broken = 1;
+	} else if (sscanf(con->data, "dump %llu", &seq) == 1) {
+		seq = trace_dump(buf, sizeof buf, &sz, seq, &head);
 
-	if (msg.timeout > 1000000) {
-		send_fail(con, "timeout cannot exceed 1000 ms");
-		return;
+		if (send_reply(con->fd, IPC_SUCCESS, seq < head ? IPC_MORE : 0, buf, sz))
+			con->broken = 1;
+	} else {
+		send_fail(con, "invalid trace command: %s", con->data);
 	}
+}
 
-	switch (msg.type) {
+/*
+ * Executes a fully received request. Returns -1 if ownership of the connection
+ * has been passed on.
+ */
+static int handle_request(struct connection *con)
+{
+	switch (con->type) {
 		struct config_ent *ent;
 		int success;
-		struct macro macro;
 
 	case IPC_MACRO:
-		while (msg.sz && msg.data[msg.sz-1] == '\n')
-			msg.data[--msg.sz] = 0;
+		while (con->sz && con->data[con->sz-1] == '\n')
+			con->data[--con->sz] = 0;
 
-		if (macro_parse(msg.data, &macro)) {
+		if (macro_parse(con->data, &con->macro)) {
 			send_fail(con, "%s", errstr);
-			return;
+			break;
 		}
 
-		macro_execute(send_key, &macro, msg.timeout);
-		send_success(con);
-
-		break;
-	case IPC_INPUT:
-		if (input(msg.data, msg.sz, msg.timeout))
-			send_fail(con, "%s", errstr);
-		else
-			send_success(con);
-		break;
+		enqueue_job(con);
+		return 0;
 	case IPC_RELOAD:
 		reload();
 		send_success(con);
 		break;
 	case IPC_LAYER_LISTEN:
-		add_listener(con);
-		break;
+		detach_connection(con);
+		add_listener(con->fd, con->hdr.flags & IPC_LISTEN_SEQ);
+		free(con);
+		return -1;
 	case IPC_BIND:
 		success = 0;
 
-		if (msg.sz == sizeof(msg.data)) {
-			send_fail(con, "bind expression size exceeded");
-			return;
-		}
-
-		msg.data[msg.sz] = 0;
-
+		lock_keyboards();
+		pthread_mutex_lock(&config_lock);
 		for (ent = configs; ent; ent = ent->next) {
-			if (!kbd_eval(ent->kbd, msg.data))
+			if (!kbd_eval(ent->kbd, con->data))
 				success = 1;
 		}
+		pthread_mutex_unlock(&config_lock);
+		unlock_keyboards();
 
 		if (success)
 			send_success(con);
 		else
 			send_fail(con, "%s", errstr);
 
+		break;
+	case IPC_APP_RESET:
+		clear_app_sections();
+		send_success(con);
+		break;
+	case IPC_APP_ADD:
+		if (add_app_section(con->section))
+			send_fail(con, "%s", errstr);
+		else
+			send_success(con);
 
+		free(con->section);
+		con->section = NULL;
+		con->section_sz = 0;
+		break;
+	case IPC_APP_FOCUS:
+		set_app_focus(con->data);
+		send_success(con);
+		break;
+	case IPC_TRACE:
+		handle_trace(con);
 		break;
 	default:
 		send_fail(con, "Unknown command");
 		break;
 	}
+
+	con->sz = 0;
+	return 0;
 }
 
-static int event_handler(struct event *ev)
+/* Validates the header of the frame being read. */
+static int check_frame(struct connection *con)
 {
-	static int last_time = 0;
-	static int timeout = 0;
-	static struct keyboard *timeout_kbd = NULL;
-	struct key_event kev = {0};
+	const struct ipc_header *hdr = &con->hdr;
+
+	if (hdr->magic != IPC_MAGIC || hdr->version != IPC_VERSION) {
+		send_fail(con, "unsupported protocol version");
+		return -1;
+	}
+
+	if (con->in_request && hdr->type != con->type) {
+		send_fail(con, "unexpected frame");
+		return -1;
+	}
+
+	/*
+	 * Input is consumed frame by frame and consequently has no size limit,
+	 * while application sections are collected in a buffer of their own.
+	 */
+	if (hdr->sz > MAX_IPC_FRAME_SIZE ||
+	    (hdr->type == IPC_APP_ADD && con->section_sz + hdr->sz > MAX_APP_SECTION_SIZE) ||
+	    (hdr->type != IPC_INPUT && hdr->type != IPC_APP_ADD &&
+	     con->sz + hdr->sz > MAX_IPC_MESSAGE_SIZE)) {
+		send_fail(con, "maximum message size exceeded");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Returns -1 if ownership of the connection has been passed on. */
+static int handle_frame(struct connection *con)
+{
+	int first = !con->in_request;
+
+	con->sz += con->hdr.sz;
+	con->data[con->sz] = 0;
+	con->in_request = con->hdr.flags & IPC_MORE;
+
+	con->hdr_sz = 0;
+	con->body_sz = 0;
+
+	if (first) {
+		con->type = con->hdr.type;
+		con->timeout = con->hdr.timeout;
+
+		if (con->timeout > 1000000) {
+			send_fail(con, "timeout cannot exceed 1000 ms");
+			con->failed = 1;
+		}
+	}
+
+	if (con->failed) {
+		con->failed = con->in_request;
+		con->sz = 0;
+		return 0;
+	}
+
+	if (con->type == IPC_INPUT) {
+		enqueue_job(con);
+		return 0;
+	}
+
+	if (con->type == IPC_APP_ADD) {
+		con->section = realloc(con->section, con->section_sz + con->sz + 1);
+		memcpy(con->section + con->section_sz, con->data, con->sz + 1);
+
+		con->section_sz += con->sz;
+		con->sz = 0;
+	}
+
+	if (con->in_request)
+		return 0;
+
+	return handle_request(con);
+}
+
+static void accept_connections()
+{
+	int fd;
+
+	while ((fd = accept(ipcfd, NULL, 0)) >= 0) {
+		struct connection *con;
+
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		if (evloop_add_fd(fd) < 0) {
+			const char msg[] = "too many connections";
+
+			send_reply(fd, IPC_FAIL, 0, msg, sizeof msg - 1);
+			close(fd);
+			continue;
+		}
+
+		con = calloc(1, sizeof *con);
+		con->fd = fd;
+		con->next = connections;
+		connections = con;
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+		perror("accept");
+		exit(-1);
+	}
+}
+
+/*
+ * Reads and executes as many frames as are available, stopping once a job
+ * has been queued on behalf of the connection.
+ */
+static void read_connection(struct connection *con)
+{
+	while (!con->busy) {
+		char *buf;
+		size_t sz;
+		ssize_t n;
+
+		if (con->broken) {
+			close_connection(con);
+			return;
+		}
+
+		if (con->hdr_sz == sizeof con->hdr && con->body_sz == con->hdr.sz) {
+			if (handle_frame(con) < 0)
+				return;
+
+			continue;
+		}
+
+		if (con->hdr_sz < sizeof con->hdr) {
+			buf = (char *)&con->hdr + con->hdr_sz;
+			sz = sizeof con->hdr - con->hdr_sz;
+		} else {
+			buf = con->data + con->sz + con->body_sz;
+			sz = con->hdr.sz - con->body_sz;
+		}
+
+		n = read(con->fd, buf, sz);
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+
+		if (n <= 0) {
+			close_connection(con);
+			return;
+		}
+
+		if (con->hdr_sz < sizeof con->hdr) {
+			con->hdr_sz += n;
+
+			if (con->hdr_sz == sizeof con->hdr && check_frame(con)) {
+				close_connection(con);
+				return;
+			}
+		} else {
+			con->body_sz += n;
+		}
+	}
+}
+
+/* Returns the earlier of timeout and the time remaining until deadline (if any). */
+static int64_t next_timeout(int64_t timeout, int64_t deadline, int64_t time)
+{
+	int64_t remaining = deadline - time;
+
+	if (!deadline)
+		return timeout;
+
+	if (remaining < 1)
+		remaining = 1;
+
+	return !timeout || remaining < timeout ? remaining : timeout;
+}
 
-	timeout -= ev->timestamp - last_time;
-	last_time = ev->timestamp;
+static int64_t event_handler(struct event *ev)
+{
+	static int64_t kbd_deadline = 0;
+	static int64_t time = 0;
+	struct key_event kev = {0};
+	int64_t timeout = -1;
+	int64_t delay;
 
-	timeout = timeout < 0 ? 0 : timeout;
+	/* Coalesce all output generated by the event into a single write. */
+	vkbd_begin(vkbd);
 
 	switch (ev->type) {
 	case EV_TIMEOUT:
-		if (!timeout_kbd)
-			return 0;
+		if (reload_deadline && ev->timestamp >= reload_deadline) {
+			reload_deadline = 0;
+
+			keyd_log("CONFIG: change detected, reloading\n");
+			start_reload();
+		}
+
+		/* The timer may also be armed on behalf of the vkbd or an IPC job. */
+		if (!timeout_kbd || !kbd_deadline || ev->timestamp < kbd_deadline)
+			break;
 
 		kev.code = 0;
-		kev.timestamp = ev->timestamp;
+		kev.timestamp = kbd_time(&time, ev->timestamp);
 
 		timeout = kbd_process_events(timeout_kbd, &kev, 1);
 		break;
 	case EV_DEV_EVENT:
 		if (ev->dev->data) {
 			struct keyboard *kbd = ev->dev->data;
-			timeout_kbd = ev->dev->data;
-			switch (ev->devev->type) {
-			case DEV_KEY:
-				dbg("input %s %s", KEY_NAME(ev->devev->code), ev->devev->pressed ? "down" : "up");
-
-				kev.code = ev->devev->code;
-				kev.pressed = ev->devev->pressed;
-				kev.timestamp = ev->timestamp;
+			uint64_t dispatch = trace_enabled ? get_time_us() : 0;
+			struct worker *w;
+			size_t i;
 
-				timeout = kbd_process_events(kbd, &kev, 1);
-				break;
-			case DEV_MOUSE_MOVE:
-				if (kbd->scroll.active) {
-					if (kbd->scroll.sensitivity == 0)
-						break;
-					int xticks, yticks;
-
-					kbd->scroll.y += ev->devev->y;
-					kbd->scroll.x += ev->devev->x;
-
-					yticks = kbd->scroll.y / kbd->scroll.sensitivity;
-					kbd->scroll.y %= kbd->scroll.sensitivity;
-
-					xticks = kbd->scroll.x / kbd->scroll.sensitivity;
-					kbd->scroll.x %= kbd->scroll.sensitivity;
-
-					vkbd_mouse_scroll(vkbd, 0, -1*yticks);
-					vkbd_mouse_scroll(vkbd, 0, xticks);
-				} else {
-					vkbd_mouse_move(vkbd, ev->devev->x, ev->devev->y);
-				}
-				break;
-			case DEV_MOUSE_MOVE_ABS:
-				vkbd_mouse_move_abs(vkbd, ev->devev->x, ev->devev->y);
-				break;
-			default:
-				break;
-			case DEV_MOUSE_SCROLL:
-				/*
-				 * Treat scroll events as mouse buttons so oneshot and the like get
-				 * cleared.
-				 */
-				if (timeout_kbd) {
-					kev.code = KEYD_EXTERNAL_MOUSE_BUTTON;
-					kev.pressed = 1;
-					kev.timestamp = ev->timestamp;
-
-					kbd_process_events(ev->dev->data, &kev, 1);
-
-					kev.pressed = 0;
-					timeout = kbd_process_events(ev->dev->data, &kev, 1);
-				}
-
-				vkbd_mouse_scroll(vkbd, ev->devev->x, ev->devev->y);
+			if (threaded && (w = lookup_worker(kbd))) {
+				worker_queue(w, ev->devevs, ev->nr_devevs);
 				break;
 			}
+
+			timeout_kbd = kbd;
+
+			for (i = 0; i < ev->nr_devevs; i++)
+				if (ev->devevs[i].type == DEV_KEY)
+					trace_event(ev->devevs[i].code, ev->devevs[i].pressed,
+						    ev->devevs[i].timestamp, dispatch);
+
+			timeout = process_device_events(kbd, ev->devevs, ev->nr_devevs, &time);
+			trace_processed();
 		}
 
 		break;
@@ -494,24 +1792,84 @@ static int event_handler(struct event *ev)
 		break;
 	case EV_FD_ACTIVITY:
 		if (ev->fd == ipcfd) {
-			int con = accept(ipcfd, NULL, 0);
-			if (con < 0) {
-				perror("accept");
-				exit(-1);
+			accept_connections();
+		} else if (ev->fd == workerfd) {
+			struct config_ent *ent;
+			uint64_t v;
+
+			if (read(workerfd, &v, sizeof v) < 0) {}
+
+			for (ent = configs; ent; ent = ent->next)
+				if (ent->worker)
+					worker_drain(ent->worker);
+		} else if (ev->fd == runnerfd) {
+			if (runner_read() < 0) {
+				evloop_remove_fd(runnerfd);
+				runnerfd = -1;
 			}
-
-			handle_client(con);
+		} else if (ev->fd == cfgmon) {
+			/* Coalesce bursts of writes into a single reload. */
+			if (cfgmon_read())
+				reload_deadline = ev->timestamp + RELOAD_DELAY;
+		} else if (ev->fd == reloadfd) {
+			finish_reload();
+
+			if (reload_again) {
+				reload_again = 0;
+				start_reload();
+			}
+		} else {
+			struct connection *con = lookup_connection(ev->fd);
+			struct listener *l = lookup_listener(ev->fd);
+
+			if (con)
+				read_connection(con);
+			else if (l)
+				service_listener(l);
+		}
+		break;
+	case EV_FD_ERR:
+		if (ev->fd != ipcfd && ev->fd != cfgmon) {
+			struct connection *con = lookup_connection(ev->fd);
+			struct listener *l = lookup_listener(ev->fd);
+
+			if (con)
+				close_connection(con);
+			else if (l)
+				remove_listener(l);
 		}
 		break;
 	default:
 		break;
 	}
 
-	return timeout;
+	/* Jobs are also started here once they have been queued. */
+	if (jobs && ev->timestamp >= job_deadline)
+		run_jobs(ev->timestamp);
+
+	if (timeout != -1)
+		kbd_deadline = timeout ? time + timeout : 0;
+
+	/*
+	 * Wake up for whichever comes first: the keyboard timeout, the next
+	 * step of an IPC job, a pending reload or the release of output
+	 * held back by the vkbd.
+	 */
+	delay = vkbd_flush(vkbd);
+	trace_commit(delay != 0);
+	flush_listeners();
+
+	delay = next_timeout(delay, kbd_deadline, ev->timestamp);
+	delay = next_timeout(delay, job_deadline, ev->timestamp);
+	delay = next_timeout(delay, reload_deadline, ev->timestamp);
+
+	return delay;
 }
 
 int run_daemon(int argc, char *argv[])
 {
+	runnerfd = runner_init();
+
 	ipcfd = ipc_create_server(SOCKET_PATH);
 	if (ipcfd < 0)
 		die("failed to create %s (another instance already running?)", SOCKET_PATH);
@@ -526,7 +1884,27 @@ int run_daemon(int argc, char *argv[])
 		exit(-1);
 	}
 
+	realtime_init();
+
+	fcntl(ipcfd, F_SETFL, fcntl(ipcfd, F_GETFL) | O_NONBLOCK);
 	evloop_add_fd(ipcfd);
+	evloop_add_fd(runnerfd);
+	cfgmon_init();
+
+	reloadfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (reloadfd < 0) {
+		perror("eventfd");
+		exit(-1);
+	}
+	evloop_add_fd(reloadfd);
+
+	if (getenv("KEYD_THREADED") && atoi(getenv("KEYD_THREADED"))) {
+		threaded = 1;
+		workerfd = worker_init(perform_output);
+		evloop_add_fd(workerfd);
+
+		keyd_log("Running keyboards in threaded mode\n");
+	}
 
 	reload();
 
@@ -23,9 +23,8 @@
 /*
  * Abstract away evdev and inotify.
  *
- * We could make this cleaner by creating a single file descriptor via epoll
- * but this would break FreeBSD compatibility without a dedicated kqueue
- * implementation. A thread based approach was also considered, but
+ * Multiplexing is left to the caller (see evloop.c, which uses epoll, provided
+ * by epoll-shim on FreeBSD). A thread based approach was also considered, but
  * inter-thread communication adds too much overhead (~100us).
  *
  * Overview:
@@ -34,11 +33,11 @@
  * and subsequently monitored for new devices read with devmon_read_device().
  *
  * A 'device' always corresponds to a keyboard or mouse from which activity can
- * be monitored with device->fd and events subsequently read using
- * device_read_event().
+ * be monitored with device->fd and events subsequently read in batches using
+ * device_read_events().
  *
- * If the event returned by device_read_event() is of type DEV_REMOVED then the
- * corresponding device should be considered invalid by the caller.
+ * If device_read_events() returns -1 then the corresponding device should be
+ * considered invalid by the caller.
  */
 
 static uint8_t resolve_device_capabilities(int fd)
@@ -86,6 +85,7 @@ static int device_init(const char *path, struct device *dev)
 {
 	int fd;
 	int capabilities;
+	int clockid = CLOCK_MONOTONIC;
 	struct input_absinfo absinfo;
 
 	if ((fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC, 0600)) < 0) {
@@ -138,6 +138,14 @@ static int device_init(const char *path, struct device *dev)
 		dev->data = NULL;
 		dev->grabbed = 0;
 
+		/*
+		 * evdev stamps events with CLOCK_REALTIME by default, which
+		 * cannot be compared with the event loop's clock.
+		 */
+		dev->_monotonic = ioctl(fd, EVIOCSCLOCKID, &clockid) == 0;
+		if (!dev->_monotonic)
+			dbg("%s: failed to set event clock, falling back to read time", dev->name);
+
 		return 0;
 	} else {
 		close(fd);
@@ -328,83 +336,67 @@ int device_ungrab(struct device *dev)
 }
 
 /*
- * Read a device event from the given device or return
- * NULL if none are available (may happen in the
- * case of a spurious wakeup).
+ * Translate a raw evdev event into a device event. Returns -1
+ * if the event should be ignored.
  */
-struct device_event *device_read_event(struct device *dev)
+static int translate_event(const struct device *dev, struct input_event *ev, struct device_event *devev)
 {
-	struct input_event ev;
-	static struct device_event devev;
-
-	assert(dev->fd != -1);
-
-	if (read(dev->fd, &ev, sizeof(ev)) < 0) {
-		if (errno == EAGAIN) {
-			return NULL;
-		} else {
-			dev->fd = -1;
-			devev.type = DEV_REMOVED;
-			return &devev;
-		}
-	}
-
-	switch (ev.type) {
+	switch (ev->type) {
 	case EV_REL:
-		switch (ev.code) {
+		switch (ev->code) {
 		case REL_WHEEL:
-			devev.type = DEV_MOUSE_SCROLL;
-			devev.y = ev.value;
-			devev.x = 0;
+			devev->type = DEV_MOUSE_SCROLL;
+			devev->y = ev->value;
+			devev->x = 0;
 
 			break;
 		case REL_HWHEEL:
-			devev.type = DEV_MOUSE_SCROLL;
-			devev.y = 0;
-			devev.x = ev.value;
+			devev->type = DEV_MOUSE_SCROLL;
+			devev->y = 0;
+			devev->x = ev->value;
 
 			break;
 		case REL_X:
-			devev.type = DEV_MOUSE_MOVE;
-			devev.x = ev.value;
-			devev.y = 0;
+			devev->type = DEV_MOUSE_MOVE;
+			devev->x = ev->value;
+			devev->y = 0;
 
 			break;
 		case REL_Y:
-			devev.type = DEV_MOUSE_MOVE;
-			devev.y = ev.value;
-			devev.x = 0;
+			devev->type = DEV_MOUSE_MOVE;
+			devev->y = ev->value;
+			devev->x = 0;
 
 			break;
 //		case REL_WHEEL_HI_RES:
 //			/* TODO: implement me */
-//			return NULL;
+//			return -1;
 //		case REL_HWHEEL_HI_RES:
 //			/* TODO: implement me */
-//			return NULL;
+//			return -1;
 		default:
-			dbg("Unrecognized EV_REL code: %d\n", ev.code);
-			return NULL;
+			dbg("Unrecognized EV_REL code: %d\n", ev->code);
+			return -1;
 		}
 
 		break;
 	case EV_ABS:
-		switch (ev.code) {
+		switch (ev->code) {
 		case ABS_X:
-			devev.type = DEV_MOUSE_MOVE_ABS;
-			devev.x = (ev.value * 1024) / (dev->_maxx - dev->_minx);
-			devev.y = 0;
+			devev->type = DEV_MOUSE_MOVE_ABS;
+			devev->x = (ev->value * 1024) / (dev->_maxx - dev->_minx);
+			devev->y = 0;
 
 			break;
 		case ABS_Y:
-			devev.type = DEV_MOUSE_MOVE_ABS;
-			devev.y = (ev.value * 1024) / (dev->_maxy - dev->_miny);
-			devev.x = 0;
+			devev->type = DEV_MOUSE_MOVE_ABS;
+			devev->y = (ev->value * 1024) / (dev->_maxy - dev->_miny);
+			devev->x = 0;
 
 			break;
 		default:
-			dbg("Unrecognized EV_ABS code: %x", ev.code);
-			break;
+			dbg("Unrecognized EV_ABS code: %x", ev->code);
+			return -1;
 		}
 
 		break;
@@ -415,52 +407,123 @@ struct device_event *device_read_event(struct device *dev)
 		 */
 
 		/* Ignore repeat events. */
-		if (ev.value == 2)
-			return NULL;
-
-		if (ev.code >= 256) {
-			if (ev.code == BTN_LEFT)
-				ev.code = KEYD_LEFT_MOUSE;
-			else if (ev.code == BTN_MIDDLE)
-				ev.code = KEYD_MIDDLE_MOUSE;
-			else if (ev.code == BTN_RIGHT)
-				ev.code = KEYD_RIGHT_MOUSE;
-			else if (ev.code == BTN_SIDE)
-				ev.code = KEYD_MOUSE_1;
-			else if (ev.code == BTN_EXTRA)
-				ev.code = KEYD_MOUSE_2;
-			else if (ev.code == BTN_BACK)
-				ev.code = KEYD_MOUSE_BACK;
-			else if (ev.code == BTN_FORWARD)
-				ev.code = KEYD_MOUSE_FORWARD;
-			else if (ev.code == KEY_FN)
-				ev.code = KEYD_FN;
-			else if (ev.code == KEY_ZOOM)
-				ev.code = KEYD_ZOOM;
-			else if (ev.code == KEY_VOICECOMMAND)
-				ev.code = KEYD_VOICECOMMAND;
-			else if (ev.code >= BTN_DIGI
-				 && ev.code <= BTN_TOOL_QUADTAP);
+		if (ev->value == 2)
+			return -1;
+
+		if (ev->code >= 256) {
+			if (ev->code == BTN_LEFT)
+				ev->code = KEYD_LEFT_MOUSE;
+			else if (ev->code == BTN_MIDDLE)
+				ev->code = KEYD_MIDDLE_MOUSE;
+			else if (ev->code == BTN_RIGHT)
+				ev->code = KEYD_RIGHT_MOUSE;
+			else if (ev->code == BTN_SIDE)
+				ev->code = KEYD_MOUSE_1;
+			else if (ev->code == BTN_EXTRA)
+				ev->code = KEYD_MOUSE_2;
+			else if (ev->code == BTN_BACK)
+				ev->code = KEYD_MOUSE_BACK;
+			else if (ev->code == BTN_FORWARD)
+				ev->code = KEYD_MOUSE_FORWARD;
+			else if (ev->code == KEY_FN)
+				ev->code = KEYD_FN;
+			else if (ev->code == KEY_ZOOM)
+				ev->code = KEYD_ZOOM;
+			else if (ev->code == KEY_VOICECOMMAND)
+				ev->code = KEYD_VOICECOMMAND;
+			else if (ev->code >= BTN_DIGI
+				 && ev->code <= BTN_TOOL_QUADTAP);
 			else {
-				keyd_log("r{ERROR:} unsupported evdev code: 0x%x\n", ev.code);
-				return NULL;
+				keyd_log("r{ERROR:} unsupported evdev code: 0x%x\n", ev->code);
+				return -1;
 			}
 		}
 
-		devev.type = DEV_KEY;
-		devev.code = ev.code;
-		devev.pressed = ev.value;
+		devev->type = DEV_KEY;
+		devev->code = ev->code;
+		devev->pressed = ev->value;
 
-		dbg2("key %s %s", KEY_NAME(devev.code), devev.pressed ? "down" : "up");
+		dbg2("key %s %s", KEY_NAME(devev->code), devev->pressed ? "down" : "up");
 
 		break;
 	default:
-		if (ev.type)
-			dbg2("unrecognized evdev event type: %d %d %d", ev.type, ev.code, ev.value);
-		return NULL;
+		if (ev->type)
+			dbg2("unrecognized evdev event type: %d %d %d", ev->type, ev->code, ev->value);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Drain up to MAX_DEVICE_EVENTS pending events from the given device using a
+ * single read() and store the translated result in the supplied array.
+ *
+ * Axis updates belonging to the same evdev report (i.e not separated by
+ * a SYN_REPORT) are merged into a single event.
+ *
+ * Returns the number of events read (which may be 0 in the case of a
+ * spurious wakeup), or -1 if the device has been removed.
+ */
+int device_read_events(struct device *dev, struct device_event events[MAX_DEVICE_EVENTS])
+{
+	struct input_event evs[MAX_DEVICE_EVENTS];
+	struct device_event *merge = NULL;
+	uint64_t now = 0;
+	ssize_t nr;
+	size_t i;
+	int n = 0;
+
+	assert(dev->fd != -1);
+
+	if ((nr = read(dev->fd, evs, sizeof evs)) < 0) {
+		if (errno == EAGAIN) {
+			return 0;
+		} else {
+			dev->fd = -1;
+			return -1;
+		}
+	}
+
+	for (i = 0; i < nr / sizeof(evs[0]); i++) {
+		struct device_event *devev = &events[n];
+
+		if (evs[i].type == EV_SYN) {
+			merge = NULL;
+			continue;
+		}
+
+		if (translate_event(dev, &evs[i], devev) < 0)
+			continue;
+
+		if (dev->_monotonic) {
+			devev->timestamp = evs[i].input_event_sec * 1000000ULL + evs[i].input_event_usec;
+		} else {
+			if (!now)
+				now = get_time_us();
+
+			devev->timestamp = now;
+		}
+
+		if (merge && merge->type == devev->type) {
+			if (devev->type == DEV_MOUSE_MOVE_ABS) {
+				if (devev->x)
+					merge->x = devev->x;
+				if (devev->y)
+					merge->y = devev->y;
+			} else {
+				merge->x += devev->x;
+				merge->y += devev->y;
+			}
+
+			continue;
+		}
+
+		merge = devev->type == DEV_KEY ? NULL : devev;
+		n++;
 	}
 
-	return &devev;
+	return n;
 }
 
 void device_set_led(const struct device *dev, int led, int state)
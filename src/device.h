@@ -13,11 +13,12 @@
 #define CAP_KEYBOARD	0x4
 
 #define MAX_DEVICES	64
+#define MAX_DEVICE_EVENTS	64
 
 struct device {
 	/*
 	 * A file descriptor that can be used to monitor events subsequently read with
-	 * device_read_event().
+	 * device_read_events().
 	 */
 	int fd;
 
@@ -34,6 +35,8 @@ struct device {
 	uint32_t _maxy;
 	uint32_t _minx;
 	uint32_t _miny;
+	/* Set if events are stamped with CLOCK_MONOTONIC by the kernel. */
+	uint8_t _monotonic;
 
 	/* Reserved for the user. */
 	void *data;
@@ -47,18 +50,19 @@ struct device_event {
 		/* All absolute values are relative to a resolution of 1024x1024. */
 		DEV_MOUSE_MOVE_ABS,
 		DEV_MOUSE_SCROLL,
-
-		DEV_REMOVED,
 	} type;
 
 	uint8_t code;
 	uint8_t pressed;
 	uint32_t x;
 	uint32_t y;
+
+	/* The time at which the kernel received the event (CLOCK_MONOTONIC, in us). */
+	uint64_t timestamp;
 };
 
 
-struct device_event *device_read_event(struct device *dev);
+int device_read_events(struct device *dev, struct device_event events[MAX_DEVICE_EVENTS]);
 
 int device_scan(struct device devices[MAX_DEVICES]);
 int device_grab(struct device *dev);
@@ -1,9 +1,30 @@
 #include "keyd.h"
 
-#define MAX_AUX_FDS 32
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#define MAX_AUX_FDS 1024
+#define MAX_EPOLL_EVENTS 64
+
+/* Marks an auxiliary slot removed during the current dispatch cycle. */
+#define RETIRED_FD -2
+
+/*
+ * Every descriptor is registered with epoll exactly once. Device entries carry
+ * a pointer to their slot in device_table, while the remaining descriptors
+ * point at the static variable holding them so they can be told apart on
+ * dispatch. Auxiliary slots are recycled once their descriptor has been
+ * removed (marked by -1), but not before the end of the cycle in which this
+ * happened, since events for the old descriptor may still be pending.
+ */
+
+static int epfd = -1;
+static int monfd = -1;
+static int timerfd = -1;
 
 static int aux_fds[MAX_AUX_FDS];
 static size_t nr_aux_fds = 0;
+static int aux_retired = 0;
 
 struct device device_table[MAX_DEVICES];
 size_t device_table_sz;
@@ -27,27 +48,129 @@ static void panic_check(uint8_t code, uint8_t pressed)
 		die("panic sequence detected");
 }
 
-static long get_time_ms()
+static void watch_fd(int fd, void *ptr)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = ptr,
+	};
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		/* Regular files are always ready and cannot be monitored. */
+		if (errno == EPERM)
+			return;
+
+		perror("epoll_ctl");
+		exit(-1);
+	}
+}
+
+static void unwatch_fd(int fd)
 {
-	struct timespec ts;
-	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return ts.tv_sec * 1E3 + ts.tv_nsec / 1E6;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
 }
 
-int evloop(int (*event_handler) (struct event *ev))
+static void evloop_init()
+{
+	if (epfd != -1)
+		return;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(-1);
+	}
+
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerfd < 0) {
+		perror("timerfd_create");
+		exit(-1);
+	}
+
+	watch_fd(timerfd, &timerfd);
+}
+
+/* Arm the timer to fire in the given number of us (0 disarms it). */
+static void set_timer(int64_t timeout)
+{
+	static int armed = 0;
+	struct itimerspec its = {0};
+
+	if (!timeout && !armed)
+		return;
+
+	its.it_value.tv_sec = timeout / 1000000;
+	its.it_value.tv_nsec = (timeout % 1000000) * 1000;
+
+	timerfd_settime(timerfd, 0, &its, NULL);
+	armed = timeout != 0;
+}
+
+static void add_device(struct device *dev)
+{
+	watch_fd(dev->fd, dev);
+}
+
+/*
+ * Compact the device table after removals, updating the epoll registrations
+ * of any devices which have moved. This is only done at the end of each
+ * dispatch cycle so pointers in pending epoll events remain valid.
+ */
+static void prune_devices()
+{
+	size_t i;
+	size_t n = 0;
+
+	for (i = 0; i < device_table_sz; i++) {
+		if (device_table[i].fd == -1)
+			continue;
+
+		if (n != i) {
+			struct epoll_event ev = {
+				.events = EPOLLIN,
+				.data.ptr = &device_table[n],
+			};
+
+			device_table[n] = device_table[i];
+			epoll_ctl(epfd, EPOLL_CTL_MOD, device_table[n].fd, &ev);
+		}
+
+		n++;
+	}
+
+	device_table_sz = n;
+}
+
+/* Make slots retired during the last dispatch cycle available for reuse. */
+static void recycle_aux_fds()
 {
 	size_t i;
-	int timeout = 0;
-	int monfd;
 
-	struct pollfd pfds[MAX_DEVICES+MAX_AUX_FDS+1];
+	for (i = 0; i < nr_aux_fds; i++)
+		if (aux_fds[i] == RETIRED_FD)
+			aux_fds[i] = -1;
 
+	aux_retired = 0;
+}
+
+int evloop(int64_t (*event_handler) (struct event *ev))
+{
+	size_t i;
+	int64_t timeout = -1;
+
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 	struct event ev;
 
+	evloop_init();
+
 	monfd = devmon_create();
+	watch_fd(monfd, &monfd);
+
 	device_table_sz = device_scan(device_table);
 
 	for (i = 0; i < device_table_sz; i++) {
+		add_device(&device_table[i]);
+
 		ev.type = EV_DEV_ADD;
 		ev.dev = &device_table[i];
 
@@ -56,107 +179,173 @@ int evloop(int (*event_handler) (struct event *ev))
 
 	while (1) {
 		int removed = 0;
+		int expired = 0;
+		int n;
+
+		/*
+		 * The handler returns the time until it next wishes to be
+		 * woken, so the timer only needs to be updated if it was
+		 * invoked during the last cycle.
+		 */
+		if (timeout != -1) {
+			set_timer(timeout > 0 ? timeout : 0);
+			timeout = -1;
+		}
 
-		int start_time;
-		int elapsed;
-
-		pfds[0].fd = monfd;
-		pfds[0].events = POLLIN;
+		n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
 
-		for (i = 0; i < device_table_sz; i++) {
-			pfds[i+1].fd = device_table[i].fd;
-			pfds[i+1].events = POLLIN | POLLERR;
-		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 
-		for (i = 0; i < nr_aux_fds; i++) {
-			pfds[i+device_table_sz+1].fd = aux_fds[i];
-			pfds[i+device_table_sz+1].events = POLLIN | POLLERR;
+			perror("epoll_wait");
+			exit(-1);
 		}
 
-		start_time = get_time_ms();
-		poll(pfds, device_table_sz+nr_aux_fds+1, timeout > 0 ? timeout : -1);
-		ev.timestamp = get_time_ms();
-		elapsed = ev.timestamp - start_time;
+		ev.timestamp = get_time_us();
 
-		if (timeout > 0 && elapsed >= timeout) {
-			ev.type = EV_TIMEOUT;
-			ev.dev = NULL;
-			ev.devev = NULL;
-			timeout = event_handler(&ev);
-		} else {
-			timeout -= elapsed;
-		}
+		for (i = 0; i < (size_t)n; i++) {
+			void *ptr = events[i].data.ptr;
 
-		for (i = 0; i < device_table_sz; i++) {
-			if (pfds[i+1].revents) {
-				struct device_event *devev;
+			if (ptr == &timerfd) {
+				uint64_t expirations;
 
-				while ((devev = device_read_event(&device_table[i]))) {
-					if (devev->type == DEV_REMOVED) {
-						ev.type = EV_DEV_REMOVE;
-						ev.dev = &device_table[i];
+				if (read(timerfd, &expirations, sizeof expirations) >= 0)
+					expired = 1;
+			} else if (ptr == &monfd) {
+				struct device dev;
 
-						timeout = event_handler(&ev);
+				while (devmon_read_device(monfd, &dev) == 0) {
+					assert(device_table_sz < MAX_DEVICES);
+					device_table[device_table_sz++] = dev;
 
-						device_table[i].fd = -1;
-						removed = 1;
-						break;
-					} else {
-						//Handle device event
-						panic_check(devev->code, devev->pressed);
+					add_device(&device_table[device_table_sz-1]);
 
-						ev.type = EV_DEV_EVENT;
-						ev.devev = devev;
-						ev.dev = &device_table[i];
+					ev.type = EV_DEV_ADD;
+					ev.dev = &device_table[device_table_sz-1];
 
-						timeout = event_handler(&ev);
-					}
+					timeout = event_handler(&ev);
 				}
-			}
-		}
+			} else if ((int *)ptr >= aux_fds && (int *)ptr < aux_fds + MAX_AUX_FDS) {
+				/* Removed earlier in this cycle. */
+				if (*(int *)ptr < 0)
+					continue;
 
-		for (i = 0; i < nr_aux_fds; i++) {
-			short events = pfds[i+device_table_sz+1].revents;
-
-			if (events) {
-				ev.type = events & POLLERR ? EV_FD_ERR : EV_FD_ACTIVITY;
-				ev.fd = aux_fds[i];
+				ev.type = events[i].events & EPOLLERR ? EV_FD_ERR : EV_FD_ACTIVITY;
+				ev.fd = *(int *)ptr;
 
 				timeout = event_handler(&ev);
-			}
-		}
+			} else {
+				struct device *dev = ptr;
+				struct device_event devevs[MAX_DEVICE_EVENTS];
+				int fd = dev->fd;
+				int nr_devevs;
+				int j;
 
+				/* Removed earlier in this cycle. */
+				if (fd == -1)
+					continue;
 
-		if (pfds[0].revents) {
-			struct device dev;
+				nr_devevs = device_read_events(dev, devevs);
 
-			while (devmon_read_device(monfd, &dev) == 0) {
-				assert(device_table_sz < MAX_DEVICES);
-				device_table[device_table_sz++] = dev;
+				if (nr_devevs < 0) {
+					ev.type = EV_DEV_REMOVE;
+					ev.dev = dev;
 
-				ev.type = EV_DEV_ADD;
-				ev.dev = &device_table[device_table_sz-1];
+					timeout = event_handler(&ev);
 
-				timeout = event_handler(&ev);
+					unwatch_fd(fd);
+					close(fd);
+
+					removed = 1;
+				} else if (nr_devevs) {
+					for (j = 0; j < nr_devevs; j++)
+						if (devevs[j].type == DEV_KEY)
+							panic_check(devevs[j].code, devevs[j].pressed);
+
+					ev.type = EV_DEV_EVENT;
+					ev.devevs = devevs;
+					ev.nr_devevs = nr_devevs;
+					ev.dev = dev;
+
+					timeout = event_handler(&ev);
+				}
 			}
 		}
 
-		if (removed) {
-			size_t n = 0;
-			for (i = 0; i < device_table_sz; i++) {
-				if (device_table[i].fd != -1)
-					device_table[n++] = device_table[i];
-			}
-			device_table_sz = n;
+		/*
+		 * Input which arrived alongside the timer may have been
+		 * generated before it expired, so give it a chance to
+		 * preempt the timeout.
+		 */
+		if (expired) {
+			ev.type = EV_TIMEOUT;
+			ev.dev = NULL;
+			ev.devevs = NULL;
+			ev.nr_devevs = 0;
+			timeout = event_handler(&ev);
 		}
 
+		if (removed)
+			prune_devices();
+
+		if (aux_retired)
+			recycle_aux_fds();
 	}
 
 	return 0;
 }
 
-void evloop_add_fd(int fd)
+int evloop_add_fd(int fd)
 {
-	assert(nr_aux_fds < MAX_AUX_FDS);
-	aux_fds[nr_aux_fds++] = fd;
+	size_t i;
+
+	evloop_init();
+
+	for (i = 0; i < nr_aux_fds; i++)
+		if (aux_fds[i] == -1)
+			break;
+
+	if (i == MAX_AUX_FDS)
+		return -1;
+
+	if (i == nr_aux_fds)
+		nr_aux_fds++;
+
+	aux_fds[i] = fd;
+	watch_fd(fd, &aux_fds[i]);
+
+	return 0;
+}
+
+void evloop_remove_fd(int fd)
+{
+	size_t i;
+
+	for (i = 0; i < nr_aux_fds; i++) {
+		if (aux_fds[i] == fd) {
+			unwatch_fd(fd);
+			aux_fds[i] = RETIRED_FD;
+			aux_retired = 1;
+			return;
+		}
+	}
+}
+
+/* Enables or disables notification (via EV_FD_ACTIVITY) when fd becomes writable. */
+void evloop_watch_output(int fd, int enabled)
+{
+	size_t i;
+
+	for (i = 0; i < nr_aux_fds; i++) {
+		if (aux_fds[i] == fd) {
+			struct epoll_event ev = {
+				.events = EPOLLIN | (enabled ? EPOLLOUT : 0),
+				.data.ptr = &aux_fds[i],
+			};
+
+			epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+			return;
+		}
+	}
 }
@@ -0,0 +1,114 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+
+#include "keyd.h"
+
+/* The key (and whether shift is required) used to type each ASCII character. */
+static struct {
+	uint8_t code;
+	uint8_t shift;
+} ascii_table[128];
+
+static void init_ascii_table()
+{
+	static int initialized = 0;
+	int c;
+
+	if (initialized)
+		return;
+
+	for (c = 1; c < 128; c++) {
+		char s[2] = { c, 0 };
+		uint8_t code, mods;
+
+		if (!parse_key_sequence(s, &code, &mods)) {
+			ascii_table[c].code = code;
+			ascii_table[c].shift = !!(mods & MOD_SHIFT);
+		}
+	}
+
+	ascii_table[' '].code = KEYD_SPACE;
+	ascii_table['\n'].code = KEYD_ENTER;
+	ascii_table['\t'].code = KEYD_TAB;
+
+	initialized = 1;
+}
+
+static void set_shift(struct input_state *state, uint8_t shift,
+		      void (*output)(uint8_t, uint8_t))
+{
+	if (state->shift == shift)
+		return;
+
+	output(KEYD_LEFTSHIFT, shift);
+	state->shift = shift;
+}
+
+/*
+ * Types the UTF-8 character at the start of s (which contains sz bytes).
+ * Returns the number of bytes consumed, 0 if s only contains the start of a
+ * character, or -1 if the character is invalid or cannot be typed.
+ */
+int input_char(struct input_state *state, const char *s, size_t sz,
+	       void (*output)(uint8_t code, uint8_t pressed))
+{
+	uint8_t lead = s[0];
+	int csz = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+	uint32_t codepoint;
+	uint8_t codes[4];
+	int idx;
+	int i;
+
+	/* Stray continuation bytes and leads of sequences longer than 4 bytes. */
+	if ((lead >= 0x80 && lead < 0xC0) || lead >= 0xF8) {
+		err("ERROR: invalid UTF-8 sequence");
+		return -1;
+	}
+
+	if ((size_t)csz > sz)
+		return 0;
+
+	if (memchr(s, 0, csz)) {
+		err("ERROR: invalid UTF-8 sequence");
+		return -1;
+	}
+
+	if (lead < 0x80) {
+		init_ascii_table();
+
+		if (ascii_table[lead].code) {
+			set_shift(state, ascii_table[lead].shift, output);
+
+			output(ascii_table[lead].code, 1);
+			output(ascii_table[lead].code, 0);
+
+			return 1;
+		}
+	}
+
+	utf8_read_char(s, &codepoint);
+
+	if ((idx = unicode_lookup_index(codepoint)) < 0) {
+		err("ERROR: could not find code for \"%.*s\"", csz, s);
+		return -1;
+	}
+
+	set_shift(state, 0, output);
+	unicode_get_sequence(idx, codes);
+
+	for (i = 0; i < 4; i++) {
+		output(codes[i], 1);
+		output(codes[i], 0);
+	}
+
+	return csz;
+}
+
+void input_release(struct input_state *state,
+		   void (*output)(uint8_t code, uint8_t pressed))
+{
+	set_shift(state, 0, output);
+}
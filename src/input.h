@@ -0,0 +1,26 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Translates text into the key events required to type it. Consecutive
+ * shifted characters share a single shift press, which remains held until
+ * input_release() is called or an unshifted character is typed.
+ */
+struct input_state {
+	uint8_t shift;
+};
+
+int input_char(struct input_state *state, const char *s, size_t sz,
+	       void (*output)(uint8_t code, uint8_t pressed));
+void input_release(struct input_state *state,
+		   void (*output)(uint8_t code, uint8_t pressed));
+
+#endif
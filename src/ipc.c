@@ -6,8 +6,6 @@
 
 #include "keyd.h"
 
-/* TODO (maybe): settle on an API and publish the protocol. */
-
 static void chgid()
 {
 	struct group *g = getgrnam("keyd");
@@ -85,3 +83,72 @@ int ipc_create_server()
 
 	return sd;
 }
+
+/*
+ * Serializes a frame into buf, which must have room for a header and
+ * MAX_IPC_FRAME_SIZE bytes of body. Returns the size of the frame.
+ */
+size_t ipc_encode(void *buf, uint8_t type, uint32_t flags, uint32_t timeout, const void *data, size_t sz)
+{
+	struct ipc_header hdr = {
+		.magic = IPC_MAGIC,
+		.version = IPC_VERSION,
+		.type = type,
+		.flags = flags,
+		.timeout = timeout,
+		.sz = sz,
+	};
+
+	assert(sz <= MAX_IPC_FRAME_SIZE);
+
+	memcpy(buf, &hdr, sizeof hdr);
+	if (sz)
+		memcpy((char *)buf + sizeof hdr, data, sz);
+
+	return sizeof hdr + sz;
+}
+
+void ipc_send(int con, uint8_t type, uint32_t flags, uint32_t timeout, const void *data, size_t sz)
+{
+	char buf[sizeof(struct ipc_header) + MAX_IPC_FRAME_SIZE];
+
+	xwrite(con, buf, ipc_encode(buf, type, flags, timeout, data, sz));
+}
+
+static int read_full(int con, void *buf, size_t sz)
+{
+	size_t nrd = 0;
+
+	while (nrd != sz) {
+		ssize_t n = read(con, (char *)buf + nrd, sz - nrd);
+
+		if (n <= 0)
+			return -1;
+
+		nrd += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Reads a single frame, NUL terminating its body. Returns -1 if the
+ * connection was closed or the frame is invalid.
+ */
+int ipc_recv(int con, struct ipc_header *hdr, char data[MAX_IPC_FRAME_SIZE+1])
+{
+	if (read_full(con, hdr, sizeof *hdr))
+		return -1;
+
+	if (hdr->magic != IPC_MAGIC ||
+	    hdr->version != IPC_VERSION ||
+	    hdr->sz > MAX_IPC_FRAME_SIZE)
+		return -1;
+
+	if (read_full(con, data, hdr->sz))
+		return -1;
+
+	data[hdr->sz] = 0;
+
+	return 0;
+}
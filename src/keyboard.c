@@ -6,7 +6,10 @@
 
 #include "keyd.h"
 
-static long process_event(struct keyboard *kbd, uint8_t code, int pressed, long time);
+/* Config timeouts are given in ms, keyboard time is kept in us. */
+#define MS(x) ((int64_t)(x) * 1000)
+
+static int64_t process_event(struct keyboard *kbd, uint8_t code, int pressed, int64_t time);
 
 /*
  * Here be tiny dragons.
@@ -19,6 +22,86 @@ static long get_time()
 	return time++;
 }
 
+static void swap_timers(struct keyboard *kbd, size_t a, size_t b)
+{
+	struct timer_entry tmp = kbd->timers[a];
+
+	kbd->timers[a] = kbd->timers[b];
+	kbd->timers[b] = tmp;
+
+	kbd->timer_pos[kbd->timers[a].id] = a;
+	kbd->timer_pos[kbd->timers[b].id] = b;
+}
+
+/* Restores the heap property for the timer at index i. */
+static void fix_timer(struct keyboard *kbd, size_t i)
+{
+	while (i && kbd->timers[i].expire < kbd->timers[(i-1)/2].expire) {
+		swap_timers(kbd, i, (i-1)/2);
+		i = (i-1)/2;
+	}
+
+	while (1) {
+		size_t min = i;
+		size_t l = 2*i + 1;
+		size_t r = 2*i + 2;
+
+		if (l < kbd->nr_timers && kbd->timers[l].expire < kbd->timers[min].expire)
+			min = l;
+		if (r < kbd->nr_timers && kbd->timers[r].expire < kbd->timers[min].expire)
+			min = r;
+
+		if (min == i)
+			break;
+
+		swap_timers(kbd, i, min);
+		i = min;
+	}
+}
+
+static void cancel_timeout(struct keyboard *kbd, enum timer id)
+{
+	int i = kbd->timer_pos[id];
+
+	if (i == -1)
+		return;
+
+	kbd->timer_pos[id] = -1;
+	kbd->nr_timers--;
+
+	if ((size_t)i != kbd->nr_timers) {
+		kbd->timers[i] = kbd->timers[kbd->nr_timers];
+		kbd->timer_pos[kbd->timers[i].id] = i;
+
+		fix_timer(kbd, i);
+	}
+}
+
+/* (Re)arms the given timer, superseding any previous expiry. */
+static void schedule_timeout(struct keyboard *kbd, enum timer id, int64_t expire)
+{
+	int i = kbd->timer_pos[id];
+
+	if (i == -1) {
+		i = kbd->nr_timers++;
+
+		kbd->timers[i].id = id;
+		kbd->timer_pos[id] = i;
+	}
+
+	kbd->timers[i].expire = expire;
+	fix_timer(kbd, i);
+}
+
+/* Discards expired timers and returns the time until the next one (0 if none). */
+static int64_t calculate_main_loop_timeout(struct keyboard *kbd, int64_t time)
+{
+	while (kbd->nr_timers && kbd->timers[0].expire <= time)
+		cancel_timeout(kbd, kbd->timers[0].id);
+
+	return kbd->nr_timers ? kbd->timers[0].expire - time : 0;
+}
+
 static int cache_set(struct keyboard *kbd, uint8_t code, struct cache_entry *ent)
 {
 	size_t i;
@@ -97,7 +180,7 @@ static void clear_mod(struct keyboard *kbd, uint8_t code)
 			 code == KEYD_LEFTALT ||
 			 code == KEYD_RIGHTALT)) &&
 		       !kbd->inhibit_modifier_guard &&
-		       !kbd->config.disable_modifier_guard);
+		       !kbd->config->disable_modifier_guard);
 
 	if (guard && !kbd->keystate[KEYD_LEFTCTRL]) {
 		send_key(kbd, KEYD_LEFTCTRL, 1);
@@ -129,12 +212,12 @@ static void set_mods(struct keyboard *kbd, uint8_t mods)
 static void update_mods(struct keyboard *kbd, int excluded_layer_idx, uint8_t mods)
 {
 	size_t i;
-	struct layer *excluded_layer = excluded_layer_idx == -1 ?
+	const struct layer *excluded_layer = excluded_layer_idx == -1 ?
 					NULL :
-					&kbd->config.layers[excluded_layer_idx];
+					&kbd->config->layers[excluded_layer_idx];
 
-	for (i = 0; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
+	for (i = 0; i < kbd->config->nr_layers; i++) {
+		const struct layer *layer = &kbd->config->layers[i];
 		int excluded = 0;
 
 		if (!kbd->layer_state[i].active)
@@ -157,7 +240,24 @@ static void update_mods(struct keyboard *kbd, int excluded_layer_idx, uint8_t mo
 	set_mods(kbd, mods);
 }
 
-static void execute_macro(struct keyboard *kbd, int dl, const struct macro *macro)
+static void step_macro(struct keyboard *kbd, int64_t time)
+{
+	int64_t timeout = macro_step(&kbd->macro_player, kbd->output.send_key);
+
+	if (timeout) {
+		kbd->macro_step_time = time + timeout;
+		schedule_timeout(kbd, TIMER_MACRO, kbd->macro_step_time);
+	}
+}
+
+/* Plays back the remainder of the current macro without pausing. */
+static void finish_macro(struct keyboard *kbd)
+{
+	while (macro_step(&kbd->macro_player, kbd->output.send_key))
+		;
+}
+
+static void execute_macro(struct keyboard *kbd, int dl, const struct macro *macro, int64_t time)
 {
 	/* Minimize redundant modifier strokes for simple key sequences. */
 	if (macro->sz == 1 && macro->entries[0].type == MACRO_KEYSEQUENCE) {
@@ -168,13 +268,28 @@ static void execute_macro(struct keyboard *kbd, int dl, const struct macro *macr
 		send_key(kbd, code, 1);
 		send_key(kbd, code, 0);
 	} else {
+		/* Only one macro may be played back at a time. */
+		finish_macro(kbd);
+
 		update_mods(kbd, dl, 0);
-		macro_execute(kbd->output.send_key, macro, kbd->config.macro_sequence_timeout);
+		macro_start(&kbd->macro_player, macro, kbd->config->macro_sequence_timeout);
+		step_macro(kbd, time);
 	}
 }
 
-static void lookup_descriptor(struct keyboard *kbd, uint8_t code,
-			      struct descriptor *d, int *dl)
+static void invalidate_keymap(struct keyboard *kbd)
+{
+	kbd->keymap_generation++;
+
+	/* Avoid matching stale entries after wrapping around. */
+	if (!kbd->keymap_generation) {
+		memset(kbd->keymap, 0, sizeof kbd->keymap);
+		kbd->keymap_generation = 1;
+	}
+}
+
+static void resolve_descriptor(struct keyboard *kbd, uint8_t code,
+			       struct descriptor *d, int *dl)
 {
 	size_t max;
 	size_t i;
@@ -183,17 +298,8 @@ static void lookup_descriptor(struct keyboard *kbd, uint8_t code,
 
 	long maxts = 0;
 
-	if (code >= KEYD_CHORD_1 && code <= KEYD_CHORD_MAX) {
-		size_t idx = code - KEYD_CHORD_1;
-
-		*d = kbd->active_chords[idx].chord.d;
-		*dl = kbd->active_chords[idx].layer;
-
-		return;
-	}
-
-	for (i = 0; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
+	for (i = 0; i < kbd->config->nr_layers; i++) {
+		const struct layer *layer = &kbd->config->layers[i];
 
 		if (kbd->layer_state[i].active) {
 			long activation_time = kbd->layer_state[i].activation_time;
@@ -208,8 +314,8 @@ static void lookup_descriptor(struct keyboard *kbd, uint8_t code,
 
 	max = 0;
 	/* Scan for any composite matches (which take precedence). */
-	for (i = 0; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
+	for (i = 0; i < kbd->config->nr_layers; i++) {
+		const struct layer *layer = &kbd->config->layers[i];
 
 		if (layer->type == LT_COMPOSITE) {
 			size_t j;
@@ -218,7 +324,7 @@ static void lookup_descriptor(struct keyboard *kbd, uint8_t code,
 
 			for (j = 0; j < layer->nr_constituents; j++) {
 				if (kbd->layer_state[layer->constituents[j]].active)
-					mods |= kbd->config.layers[layer->constituents[j]].mods;
+					mods |= kbd->config->layers[layer->constituents[j]].mods;
 				else
 					match = 0;
 			}
@@ -240,14 +346,36 @@ static void lookup_descriptor(struct keyboard *kbd, uint8_t code,
 	}
 }
 
+static void lookup_descriptor(struct keyboard *kbd, uint8_t code,
+			      struct descriptor *d, int *dl)
+{
+	if (code >= KEYD_CHORD_1 && code <= KEYD_CHORD_MAX) {
+		size_t idx = code - KEYD_CHORD_1;
+
+		*d = kbd->active_chords[idx].chord.d;
+		*dl = kbd->active_chords[idx].layer;
+
+		return;
+	}
+
+	if (kbd->keymap[code].generation != kbd->keymap_generation) {
+		resolve_descriptor(kbd, code, &kbd->keymap[code].d, &kbd->keymap[code].dl);
+		kbd->keymap[code].generation = kbd->keymap_generation;
+	}
+
+	*d = kbd->keymap[code].d;
+	*dl = kbd->keymap[code].dl;
+}
+
 static void deactivate_layer(struct keyboard *kbd, int idx)
 {
-	dbg("Deactivating layer %s", kbd->config.layers[idx].name);
+	dbg("Deactivating layer %s", kbd->config->layers[idx].name);
 
 	assert(kbd->layer_state[idx].active > 0);
 	kbd->layer_state[idx].active--;
+	invalidate_keymap(kbd);
 
-	kbd->output.on_layer_change(kbd, kbd->config.layers[idx].name, 0);
+	kbd->output.on_layer_change(kbd, kbd->config->layers[idx].name, 0);
 }
 
 /*
@@ -257,16 +385,17 @@ static void deactivate_layer(struct keyboard *kbd, int idx)
 
 static void activate_layer(struct keyboard *kbd, uint8_t code, int idx)
 {
-	dbg("Activating layer %s", kbd->config.layers[idx].name);
+	dbg("Activating layer %s", kbd->config->layers[idx].name);
 	struct cache_entry *ce;
 
 	kbd->layer_state[idx].activation_time = get_time();
 	kbd->layer_state[idx].active++;
+	invalidate_keymap(kbd);
 
 	if ((ce = cache_get(kbd, code)))
 		ce->layer = idx;
 
-	kbd->output.on_layer_change(kbd, kbd->config.layers[idx].name, 1);
+	kbd->output.on_layer_change(kbd, kbd->config->layers[idx].name, 1);
 }
 
 /* Returns:
@@ -274,37 +403,34 @@ static void activate_layer(struct keyboard *kbd, uint8_t code, int idx)
  *  1 on partial match
  *  2 on exact match
  */
-static int chord_event_match(struct chord *chord, struct key_event *events, size_t nevents)
+/* Returns 1 if every key in a is also contained in b. */
+static int keymask_subset(const uint64_t a[4], const uint64_t b[4])
 {
-	size_t i, j;
-	size_t n = 0;
-	size_t npressed = 0;
+	return !((a[0] & ~b[0]) |
+		 (a[1] & ~b[1]) |
+		 (a[2] & ~b[2]) |
+		 (a[3] & ~b[3]));
+}
 
-	if (!nevents)
+static int chord_event_match(struct keyboard *kbd, const struct chord *chord)
+{
+	if (!kbd->chord.queue_npressed)
 		return 0;
 
-	for (i = 0; i < nevents; i++)
-		if (events[i].pressed) {
-			int found = 0;
-
-			npressed++;
-			for (j = 0; j < chord->sz; j++)
-				if (chord->keys[j] == events[i].code)
-					found = 1;
+	if (!keymask_subset(kbd->chord.queue_keymask, chord->keymask))
+		return 0;
 
-			if (!found)
-				return 0;
-			else
-				n++;
-		}
+	return kbd->chord.queue_npressed == chord->sz ? 2 : 1;
+}
 
-	if (npressed == 0)
-		return 0;
-	else
-		return n == chord->sz ? 2 : 1;
+static void reset_chord_queue(struct keyboard *kbd)
+{
+	kbd->chord.queue_sz = 0;
+	kbd->chord.queue_npressed = 0;
+	memset(kbd->chord.queue_keymask, 0, sizeof kbd->chord.queue_keymask);
 }
 
-static void enqueue_chord_event(struct keyboard *kbd, uint8_t code, uint8_t pressed, long time)
+static void enqueue_chord_event(struct keyboard *kbd, uint8_t code, uint8_t pressed, int64_t time)
 {
 	if (!code)
 		return;
@@ -316,6 +442,11 @@ static void enqueue_chord_event(struct keyboard *kbd, uint8_t code, uint8_t pres
 	kbd->chord.queue[kbd->chord.queue_sz].timestamp = time;
 
 	kbd->chord.queue_sz++;
+
+	if (pressed) {
+		kbd->chord.queue_keymask[code >> 6] |= 1ULL << (code & 63);
+		kbd->chord.queue_npressed++;
+	}
 }
 
 /* Returns:
@@ -324,29 +455,31 @@ static void enqueue_chord_event(struct keyboard *kbd, uint8_t code, uint8_t pres
  *  2 in the case of an unambiguous match (populating chord and layer)
  *  3 in the case of an ambiguous match (populating chord and layer)
  */
-static int check_chord_match(struct keyboard *kbd, const struct chord **chord, int *chord_layer)
+static int check_chord_match(struct keyboard *kbd, int *chord, int *chord_layer)
 {
 	size_t idx;
 	int full_match = 0;
 	int partial_match = 0;
 	long maxts = -1;
 
-	for (idx = 0; idx < kbd->config.nr_layers; idx++) {
+	for (idx = 0; idx < kbd->config->nr_layers; idx++) {
 		size_t i;
-		struct layer *layer = &kbd->config.layers[idx];
+		const struct layer *layer = &kbd->config->layers[idx];
 
 		if (!kbd->layer_state[idx].active)
 			continue;
 
+		/* Skip layers which cannot contain a match. */
+		if (!keymask_subset(kbd->chord.queue_keymask, layer->chord_keymask))
+			continue;
+
 		for (i = 0; i < layer->nr_chords; i++) {
-			int ret = chord_event_match(&layer->chords[i],
-						    kbd->chord.queue,
-						    kbd->chord.queue_sz);
+			int ret = chord_event_match(kbd, &layer->chords[i]);
 
 			if (ret == 2 &&
 				maxts <= kbd->layer_state[idx].activation_time) {
 				*chord_layer = (int)idx;
-				*chord = &layer->chords[i];
+				*chord = (int)i;
 
 				full_match = 1;
 				maxts = kbd->layer_state[idx].activation_time;
@@ -364,42 +497,11 @@ static int check_chord_match(struct keyboard *kbd, const struct chord **chord, i
 		return 0;
 }
 
-static void execute_command(const char *cmd)
-{
-	int fd;
-
-	dbg("executing command: %s", cmd);
-
-	if (fork()) {
-		wait(NULL);
-		return;
-	}
-	if (fork())
-		exit(0);
-
-	fd = open("/dev/null", O_RDWR);
-
-	if (fd < 0) {
-		perror("open");
-		exit(-1);
-	}
-
-	close(0);
-	close(1);
-	close(2);
-
-	dup2(fd, 0);
-	dup2(fd, 1);
-	dup2(fd, 2);
-
-	execl("/bin/sh", "/bin/sh", "-c", cmd, NULL);
-}
-
 static void clear_oneshot(struct keyboard *kbd)
 {
 	size_t i = 0;
 
-	for (i = 0; i < kbd->config.nr_layers; i++)
+	for (i = 0; i < kbd->config->nr_layers; i++)
 		while (kbd->layer_state[i].oneshot_depth) {
 			deactivate_layer(kbd, i);
 			kbd->layer_state[i].oneshot_depth--;
@@ -407,14 +509,15 @@ static void clear_oneshot(struct keyboard *kbd)
 
 	kbd->oneshot_latch = 0;
 	kbd->oneshot_timeout = 0;
+	cancel_timeout(kbd, TIMER_ONESHOT);
 }
 
 static void clear(struct keyboard *kbd)
 {
 	size_t i;
 	clear_oneshot(kbd);
-	for (i = 1; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
+	for (i = 1; i < kbd->config->nr_layers; i++) {
+		const struct layer *layer = &kbd->config->layers[i];
 
 		if (layer->type != LT_LAYOUT) {
 			if (kbd->layer_state[i].toggled) {
@@ -424,7 +527,8 @@ static void clear(struct keyboard *kbd)
 		}
 	}
 
-	kbd->active_macro = NULL;
+	kbd->active_macro = -1;
+	cancel_timeout(kbd, TIMER_MACRO_REPEAT);
 
 	reset_keystate(kbd);
 }
@@ -434,8 +538,8 @@ static void setlayout(struct keyboard *kbd, uint8_t idx)
 	clear(kbd);
 	/* Only only layout may be active at a time */
 	size_t i;
-	for (i = 0; i < kbd->config.nr_layers; i++) {
-		struct layer *layer = &kbd->config.layers[i];
+	for (i = 0; i < kbd->config->nr_layers; i++) {
+		const struct layer *layer = &kbd->config->layers[i];
 
 		if (layer->type == LT_LAYOUT)
 			kbd->layer_state[i].active = 0;
@@ -443,48 +547,26 @@ static void setlayout(struct keyboard *kbd, uint8_t idx)
 
 	kbd->layer_state[idx].activation_time = 1;
 	kbd->layer_state[idx].active = 1;
-}
-
 
-static void schedule_timeout(struct keyboard *kbd, long timeout)
-{
-	assert(kbd->nr_timeouts < ARRAY_SIZE(kbd->timeouts));
-	kbd->timeouts[kbd->nr_timeouts++] = timeout;
+	invalidate_keymap(kbd);
 }
 
-static long calculate_main_loop_timeout(struct keyboard *kbd, long time)
-{
-	size_t i;
-	long timeout = 0;
-	size_t n = 0;
-
-	for (i = 0; i < kbd->nr_timeouts; i++)
-		if (kbd->timeouts[i] > time) {
-			if (!timeout || kbd->timeouts[i] < timeout)
-				timeout = kbd->timeouts[i];
-
-			kbd->timeouts[n++] = kbd->timeouts[i];
-		}
-
-	kbd->nr_timeouts = n;
-	return timeout ? timeout - time : 0;
-}
 
-static long process_descriptor(struct keyboard *kbd, uint8_t code,
-			       const struct descriptor *d, int dl,
-			       int pressed, long time)
+static int64_t process_descriptor(struct keyboard *kbd, uint8_t code,
+				  const struct descriptor *d, int dl,
+				  int pressed, int64_t time)
 {
-	int timeout = 0;
+	int64_t timeout = 0;
 
 	if (pressed) {
-		struct macro *macro;
+		const struct macro *macro;
 
 		switch (d->op) {
 		case OP_LAYERM:
 		case OP_ONESHOTM:
 		case OP_TOGGLEM:
-			macro = &kbd->config.macros[d->args[1].idx];
-			execute_macro(kbd, dl, macro);
+			macro = &kbd->config->macros[d->args[1].idx];
+			execute_macro(kbd, dl, macro, time);
 			break;
 		default:
 			break;
@@ -493,8 +575,8 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 
 	switch (d->op) {
 		int idx;
-		struct macro *macro;
-		struct descriptor *action;
+		const struct macro *macro;
+		const struct descriptor *action;
 		uint8_t mods;
 		uint8_t new_code;
 
@@ -537,7 +619,7 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 	case OP_OVERLOAD_TIMEOUT:
 		if (pressed) {
 			uint8_t layer = d->args[0].idx;
-			struct descriptor *action = &kbd->config.descriptors[d->args[1].idx];
+			const struct descriptor *action = &kbd->config->descriptors[d->args[1].idx];
 
 			kbd->pending_key.code = code;
 			kbd->pending_key.behaviour =
@@ -548,9 +630,9 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 			kbd->pending_key.action1 = *action;
 			kbd->pending_key.action2.op = OP_LAYER;
 			kbd->pending_key.action2.args[0].idx = layer;
-			kbd->pending_key.expire = time+d->args[2].timeout;
+			kbd->pending_key.expire = time + MS(d->args[2].timeout);
 
-			schedule_timeout(kbd, kbd->pending_key.expire);
+			schedule_timeout(kbd, TIMER_PENDING_KEY, kbd->pending_key.expire);
 		}
 
 		break;
@@ -581,8 +663,8 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 	case OP_CLEARM:
 		if(pressed) {
 			clear(kbd);
-			macro = &kbd->config.macros[d->args[0].idx];
-			execute_macro(kbd, dl, macro);
+			macro = &kbd->config->macros[d->args[0].idx];
+			execute_macro(kbd, dl, macro, time);
 		}
 		break;
 	case OP_CLEAR:
@@ -591,7 +673,7 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 		break;
 	case OP_OVERLOAD:
 		idx = d->args[0].idx;
-		action = &kbd->config.descriptors[d->args[1].idx];
+		action = &kbd->config->descriptors[d->args[1].idx];
 
 		if (pressed) {
 			kbd->overload_start_time = time;
@@ -602,8 +684,8 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 			update_mods(kbd, -1, 0);
 
 			if (kbd->last_pressed_code == code &&
-			    (!kbd->config.overload_tap_timeout ||
-			     ((time - kbd->overload_start_time) < kbd->config.overload_tap_timeout))) {
+			    (!kbd->config->overload_tap_timeout ||
+			     ((time - kbd->overload_start_time) < MS(kbd->config->overload_tap_timeout)))) {
 				process_descriptor(kbd, code, action, dl, 1, time);
 				process_descriptor(kbd, code, action, dl, 0, time);
 			}
@@ -621,9 +703,9 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 		} else {
 			if (kbd->oneshot_latch) {
 				kbd->layer_state[idx].oneshot_depth++;
-				if (kbd->config.oneshot_timeout) {
-					kbd->oneshot_timeout = time + kbd->config.oneshot_timeout;
-					schedule_timeout(kbd, kbd->oneshot_timeout);
+				if (kbd->config->oneshot_timeout) {
+					kbd->oneshot_timeout = time + MS(kbd->config->oneshot_timeout);
+					schedule_timeout(kbd, TIMER_ONESHOT, kbd->oneshot_timeout);
 				}
 			} else {
 				deactivate_layer(kbd, idx);
@@ -635,26 +717,28 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 	case OP_MACRO2:
 	case OP_MACRO:
 		if (pressed) {
+			int macro_idx;
+
 			if (d->op == OP_MACRO2) {
-				macro = &kbd->config.macros[d->args[2].idx];
+				macro_idx = d->args[2].idx;
 
-				timeout = d->args[0].timeout;
-				kbd->macro_repeat_interval = d->args[1].timeout;
+				timeout = MS(d->args[0].timeout);
+				kbd->macro_repeat_interval = MS(d->args[1].timeout);
 			} else {
-				macro = &kbd->config.macros[d->args[0].idx];
+				macro_idx = d->args[0].idx;
 
-				timeout = kbd->config.macro_timeout;
-				kbd->macro_repeat_interval = kbd->config.macro_repeat_timeout;
+				timeout = MS(kbd->config->macro_timeout);
+				kbd->macro_repeat_interval = MS(kbd->config->macro_repeat_timeout);
 			}
 
 			clear_oneshot(kbd);
 
-			execute_macro(kbd, dl, macro);
-			kbd->active_macro = macro;
+			execute_macro(kbd, dl, &kbd->config->macros[macro_idx], time);
+			kbd->active_macro = macro_idx;
 			kbd->active_macro_layer = dl;
 
 			kbd->macro_timeout = time + timeout;
-			schedule_timeout(kbd, kbd->macro_timeout);
+			schedule_timeout(kbd, TIMER_MACRO_REPEAT, kbd->macro_timeout);
 		}
 
 		break;
@@ -678,21 +762,21 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 		break;
 	case OP_TIMEOUT:
 		if (pressed) {
-			kbd->pending_key.action1 = kbd->config.descriptors[d->args[0].idx];
-			kbd->pending_key.action2 = kbd->config.descriptors[d->args[2].idx];
+			kbd->pending_key.action1 = kbd->config->descriptors[d->args[0].idx];
+			kbd->pending_key.action2 = kbd->config->descriptors[d->args[2].idx];
 
 			kbd->pending_key.code = code;
 			kbd->pending_key.dl = dl;
-			kbd->pending_key.expire = time + d->args[1].timeout;
+			kbd->pending_key.expire = time + MS(d->args[1].timeout);
 			kbd->pending_key.behaviour = PK_INTERRUPT_ACTION1;
 
-			schedule_timeout(kbd, kbd->pending_key.expire);
+			schedule_timeout(kbd, TIMER_PENDING_KEY, kbd->pending_key.expire);
 		}
 
 		break;
 	case OP_COMMAND:
 		if (pressed) {
-			execute_command(kbd->config.commands[d->args[0].idx].cmd);
+			kbd->output.run_command(kbd->config->commands[d->args[0].idx].cmd);
 			clear_oneshot(kbd);
 			update_mods(kbd, -1, 0);
 		}
@@ -700,7 +784,7 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 	case OP_SWAP:
 	case OP_SWAPM:
 		idx = d->args[0].idx;
-		macro = d->op == OP_SWAPM ?  &kbd->config.macros[d->args[1].idx] : NULL;
+		macro = d->op == OP_SWAPM ?  &kbd->config->macros[d->args[1].idx] : NULL;
 
 		if (pressed) {
 			size_t i;
@@ -710,8 +794,12 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 				deactivate_layer(kbd, dl);
 				kbd->layer_state[dl].toggled = 0;
 
-				activate_layer(kbd, 0, idx);
-				kbd->layer_state[idx].toggled = 1;
+				/* Activating an already toggled target again would leak a reference. */
+				if (!kbd->layer_state[idx].toggled) {
+					activate_layer(kbd, 0, idx);
+					kbd->layer_state[idx].toggled = 1;
+				}
+
 				update_mods(kbd, -1, 0);
 			} else if (kbd->layer_state[dl].oneshot_depth) {
 				deactivate_layer(kbd, dl);
@@ -724,7 +812,7 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 				for (i = 0; i < CACHE_SIZE; i++) {
 					uint8_t code = kbd->cache[i].code;
 					int layer = kbd->cache[i].layer;
-					int type = kbd->config.layers[layer].type;
+					int type = kbd->config->layers[layer].type;
 
 					if (code && layer == dl && type == LT_NORMAL && layer != 0) {
 						ce = &kbd->cache[i];
@@ -744,7 +832,7 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 			}
 
 			if (macro)
-				execute_macro(kbd, dl, macro);
+				execute_macro(kbd, dl, macro, time);
 		} else {
 			if (macro &&
 			    macro->sz == 1 &&
@@ -765,28 +853,28 @@ static long process_descriptor(struct keyboard *kbd, uint8_t code,
 	return timeout;
 }
 
-struct keyboard *new_keyboard(struct config *config, const struct output *output)
+struct keyboard *new_keyboard(const struct config *config, const struct output *output)
 {
 	size_t i;
 	struct keyboard *kbd;
 
 	kbd = calloc(1, sizeof(struct keyboard));
 
+	kbd->config = config;
 	kbd->original_config = config;
-	memcpy(&kbd->config, kbd->original_config, sizeof(struct config));
 
 	kbd->output = *output;
 	kbd->layer_state[0].active = 1;
 	kbd->layer_state[0].activation_time = 0;
 
-	if (kbd->config.default_layout[0]) {
+	if (kbd->config->default_layout[0]) {
 		int found = 0;
-		for (i = 0; i < kbd->config.nr_layers; i++) {
-			struct layer *layer = &kbd->config.layers[i];
+		for (i = 0; i < kbd->config->nr_layers; i++) {
+			const struct layer *layer = &kbd->config->layers[i];
 
 			if (layer->type == LT_LAYOUT &&
 			    !strcmp(layer->name,
-				    kbd->config.default_layout)) {
+				    kbd->config->default_layout)) {
 				kbd->layer_state[i].active = 1;
 				kbd->layer_state[i].activation_time = 1;
 				found = 1;
@@ -796,11 +884,18 @@ struct keyboard *new_keyboard(struct config *config, const struct output *output
 
 		if (!found)
 			keyd_log("\tWARNING: could not find default layout %s.\n",
-				kbd->config.default_layout);
+				kbd->config->default_layout);
 	}
 
-	kbd->chord.queue_sz = 0;
+	reset_chord_queue(kbd);
 	kbd->chord.state = CHORD_INACTIVE;
+	kbd->chord.match = -1;
+	kbd->active_macro = -1;
+
+	for (i = 0; i < TIMER_MAX; i++)
+		kbd->timer_pos[i] = -1;
+
+	invalidate_keymap(kbd);
 
 	return kbd;
 }
@@ -808,11 +903,12 @@ struct keyboard *new_keyboard(struct config *config, const struct output *output
 static int resolve_chord(struct keyboard *kbd)
 {
 	size_t queue_offset = 0;
-	const struct chord *chord = kbd->chord.match;
 
 	kbd->chord.state = CHORD_RESOLVING;
+	cancel_timeout(kbd, TIMER_CHORD);
 
-	if (chord) {
+	if (kbd->chord.match != -1) {
+		const struct chord *chord = &kbd->config->layers[kbd->chord.match_layer].chords[kbd->chord.match];
 		size_t i;
 		uint8_t code = 0;
 
@@ -844,16 +940,16 @@ static int resolve_chord(struct keyboard *kbd)
 
 static int abort_chord(struct keyboard *kbd)
 {
-	kbd->chord.match = NULL;
+	kbd->chord.match = -1;
 	return resolve_chord(kbd);
 }
 
 static int handle_chord(struct keyboard *kbd,
-			uint8_t code, int pressed, long time)
+			uint8_t code, int pressed, int64_t time)
 {
 	size_t i;
-	const long interkey_timeout = kbd->config.chord_interkey_timeout;
-	const long hold_timeout = kbd->config.chord_hold_timeout;
+	const int64_t interkey_timeout = MS(kbd->config->chord_interkey_timeout);
+	const int64_t hold_timeout = MS(kbd->config->chord_hold_timeout);
 
 	if (code && !pressed) {
 		for (i = 0; i < ARRAY_SIZE(kbd->active_chords); i++) {
@@ -891,8 +987,8 @@ static int handle_chord(struct keyboard *kbd,
 	case CHORD_RESOLVING:
 		return 0;
 	case CHORD_INACTIVE:
-		kbd->chord.queue_sz = 0;
-		kbd->chord.match = NULL;
+		reset_chord_queue(kbd);
+		kbd->chord.match = -1;
 		kbd->chord.start_code = code;
 
 		enqueue_chord_event(kbd, code, pressed, time);
@@ -903,7 +999,7 @@ static int handle_chord(struct keyboard *kbd,
 			case 1:
 				kbd->chord.state = CHORD_PENDING_DISAMBIGUATION;
 				kbd->chord.last_code_time = time;
-				schedule_timeout(kbd, time + interkey_timeout);
+				schedule_timeout(kbd, TIMER_CHORD, time + interkey_timeout);
 				return 1;
 			default:
 			case 2:
@@ -911,7 +1007,7 @@ static int handle_chord(struct keyboard *kbd,
 
 				if (hold_timeout) {
 					kbd->chord.state = CHORD_PENDING_HOLD_TIMEOUT;
-					schedule_timeout(kbd, time + hold_timeout);
+					schedule_timeout(kbd, TIMER_CHORD, time + hold_timeout);
 				} else {
 					return resolve_chord(kbd);
 				}
@@ -920,10 +1016,10 @@ static int handle_chord(struct keyboard *kbd,
 	case CHORD_PENDING_DISAMBIGUATION:
 		if (!code) {
 			if ((time - kbd->chord.last_code_time) >= interkey_timeout) {
-				if (kbd->chord.match) {
-					long timeleft = hold_timeout - interkey_timeout;
+				if (kbd->chord.match != -1) {
+					int64_t timeleft = hold_timeout - interkey_timeout;
 					if (timeleft > 0) {
-						schedule_timeout(kbd, time + timeleft);
+						schedule_timeout(kbd, TIMER_CHORD, time + timeleft);
 						kbd->chord.state = CHORD_PENDING_HOLD_TIMEOUT;
 					} else {
 						return resolve_chord(kbd);
@@ -951,7 +1047,7 @@ static int handle_chord(struct keyboard *kbd,
 				kbd->chord.last_code_time = time;
 
 				kbd->chord.state = CHORD_PENDING_DISAMBIGUATION;
-				schedule_timeout(kbd, time + interkey_timeout);
+				schedule_timeout(kbd, TIMER_CHORD, time + interkey_timeout);
 				return 1;
 			default:
 			case 2:
@@ -959,7 +1055,7 @@ static int handle_chord(struct keyboard *kbd,
 
 				if (hold_timeout) {
 					kbd->chord.state = CHORD_PENDING_HOLD_TIMEOUT;
-					schedule_timeout(kbd, time + hold_timeout);
+					schedule_timeout(kbd, TIMER_CHORD, time + hold_timeout);
 				} else {
 					return resolve_chord(kbd);
 				}
@@ -976,10 +1072,11 @@ static int handle_chord(struct keyboard *kbd,
 		enqueue_chord_event(kbd, code, pressed, time);
 
 		if (!pressed) {
+			const struct chord *chord = &kbd->config->layers[kbd->chord.match_layer].chords[kbd->chord.match];
 			size_t i;
 
-			for (i = 0; i < kbd->chord.match->sz; i++)
-				if (kbd->chord.match->keys[i] == code)
+			for (i = 0; i < chord->sz; i++)
+				if (chord->keys[i] == code)
 					return abort_chord(kbd);
 		}
 
@@ -989,7 +1086,7 @@ static int handle_chord(struct keyboard *kbd,
 	return 0;
 }
 
-int handle_pending_key(struct keyboard *kbd, uint8_t code, int pressed, long time)
+int handle_pending_key(struct keyboard *kbd, uint8_t code, int pressed, int64_t time)
 {
 	if (!kbd->pending_key.code)
 		return 0;
@@ -1060,6 +1157,7 @@ int handle_pending_key(struct keyboard *kbd, uint8_t code, int pressed, long tim
 		kbd->pending_key.code = 0;
 		kbd->pending_key.queue_sz = 0;
 		kbd->pending_key.tap_expiry = 0;
+		cancel_timeout(kbd, TIMER_PENDING_KEY);
 
 		process_descriptor(kbd, code, &action, dl, 1, time);
 		cache_set(kbd, code, &(struct cache_entry) {
@@ -1075,6 +1173,56 @@ int handle_pending_key(struct keyboard *kbd, uint8_t code, int pressed, long tim
 	return 1;
 }
 
+/*
+ * Defers input while a macro is being played back so it is not interleaved
+ * with the macro's output, and replays it once the macro has finished.
+ * Returns 1 if the event was consumed.
+ */
+static int handle_macro(struct keyboard *kbd, uint8_t code, int pressed, int64_t time)
+{
+	struct key_event queue[ARRAY_SIZE(kbd->macro_queue)];
+	size_t queue_sz;
+	size_t i;
+	int consumed = 0;
+
+	if (!kbd->macro_player.active && !kbd->macro_queue_sz)
+		return 0;
+
+	if (code) {
+		if (kbd->macro_queue_sz < ARRAY_SIZE(kbd->macro_queue)) {
+			struct key_event *ev = &kbd->macro_queue[kbd->macro_queue_sz++];
+
+			ev->code = code;
+			ev->pressed = pressed;
+			ev->timestamp = time;
+
+			consumed = 1;
+		} else {
+			/* Out of space, get the macro out of the way. */
+			finish_macro(kbd);
+		}
+	}
+
+	if (kbd->macro_player.active && time >= kbd->macro_step_time)
+		step_macro(kbd, time);
+
+	if (kbd->macro_player.active)
+		return 1;
+
+	/* Copy the queue to allow for macros triggered during replay. */
+	queue_sz = kbd->macro_queue_sz;
+	memcpy(queue, kbd->macro_queue, sizeof kbd->macro_queue);
+	kbd->macro_queue_sz = 0;
+
+	/* From the perspective of the keyboard, input arrives now. */
+	for (i = 0; i < queue_sz; i++)
+		queue[i].timestamp = time;
+
+	kbd_process_events(kbd, queue, queue_sz);
+
+	return consumed;
+}
+
 /*
  * `code` may be 0 in the event of a timeout.
  *
@@ -1082,11 +1230,14 @@ int handle_pending_key(struct keyboard *kbd, uint8_t code, int pressed, long tim
  * of process_event must take place. A return value of 0 permits the
  * main loop to call at liberty.
  */
-static long process_event(struct keyboard *kbd, uint8_t code, int pressed, long time)
+static int64_t process_event(struct keyboard *kbd, uint8_t code, int pressed, int64_t time)
 {
 	int dl = -1;
 	struct descriptor d;
 
+	if (handle_macro(kbd, code, pressed, time))
+		goto exit;
+
 	if (handle_chord(kbd, code, pressed, time))
 		goto exit;
 
@@ -1098,14 +1249,16 @@ static long process_event(struct keyboard *kbd, uint8_t code, int pressed, long
 		update_mods(kbd, -1, 0);
 	}
 
-	if (kbd->active_macro) {
+	if (kbd->active_macro != -1) {
 		if (code) {
-			kbd->active_macro = NULL;
+			kbd->active_macro = -1;
+			cancel_timeout(kbd, TIMER_MACRO_REPEAT);
 			update_mods(kbd, -1, 0);
 		} else if (time >= kbd->macro_timeout) {
-			execute_macro(kbd, kbd->active_macro_layer, kbd->active_macro);
+			execute_macro(kbd, kbd->active_macro_layer,
+				      &kbd->config->macros[kbd->active_macro], time);
 			kbd->macro_timeout = time+kbd->macro_repeat_interval;
-			schedule_timeout(kbd, kbd->macro_timeout);
+			schedule_timeout(kbd, TIMER_MACRO_REPEAT, kbd->macro_timeout);
 		}
 	}
 
@@ -1147,11 +1300,11 @@ exit:
 }
 
 
-long kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n)
+int64_t kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n)
 {
 	size_t i = 0;
-	int timeout = 0;
-	int timeout_ts = 0;
+	int64_t timeout = 0;
+	int64_t timeout_ts = 0;
 
 	while (i != n) {
 		const struct key_event *ev = &events[i];
@@ -1169,12 +1322,76 @@ long kbd_process_events(struct keyboard *kbd, const struct key_event *events, si
 	return timeout;
 }
 
+/*
+ * Switches to a config with the same layers. References into the current
+ * config carry over to their counterparts in the new one, unless the new
+ * config lacks them (e.g. a macro added by a binding which has been reset).
+ */
+static void set_config(struct keyboard *kbd, const struct config *config)
+{
+	if (kbd->active_macro >= (int)config->nr_macros) {
+		kbd->active_macro = -1;
+		cancel_timeout(kbd, TIMER_MACRO_REPEAT);
+	}
+
+	if (kbd->chord.match != -1 &&
+	    kbd->chord.match >= (int)config->layers[kbd->chord.match_layer].nr_chords)
+		kbd->chord.match = -1;
+
+	kbd->config = config;
+	invalidate_keymap(kbd);
+}
+
 int kbd_eval(struct keyboard *kbd, const char *exp)
 {
+	int ret;
+	int copied = 0;
+
 	if (!strcmp(exp, "reset")) {
-		memcpy(&kbd->config, kbd->original_config, sizeof(struct config));
+		if (kbd->private_config) {
+			set_config(kbd, kbd->original_config);
+
+			free(kbd->private_config);
+			kbd->private_config = NULL;
+		}
+
 		return 0;
-	} else {
-		return config_add_entry(&kbd->config, exp);
 	}
+
+	if (!kbd->private_config) {
+		kbd->private_config = malloc(sizeof(struct config));
+		memcpy(kbd->private_config, kbd->original_config, sizeof(struct config));
+
+		set_config(kbd, kbd->private_config);
+		copied = 1;
+	}
+
+	ret = config_add_entry(kbd->private_config, exp);
+	invalidate_keymap(kbd);
+
+	/* Don't hold on to a copy for a failed expression. */
+	if (ret < 0 && copied)
+		kbd_eval(kbd, "reset");
+
+	return ret;
+}
+
+/*
+ * Replaces the config to which the keyboard reverts on reset, discarding
+ * any bindings applied with kbd_eval(). The config must share the layout of
+ * the original one and outlive its use by the keyboard.
+ */
+void kbd_set_base_config(struct keyboard *kbd, const struct config *config)
+{
+	set_config(kbd, config);
+
+	free(kbd->private_config);
+	kbd->private_config = NULL;
+	kbd->original_config = config;
+}
+
+void free_keyboard(struct keyboard *kbd)
+{
+	free(kbd->private_config);
+	free(kbd);
 }
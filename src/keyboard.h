@@ -17,6 +17,17 @@
 
 struct keyboard;
 
+/* Each timer has at most one pending expiry, see schedule_timeout(). */
+enum timer {
+	TIMER_CHORD,
+	TIMER_PENDING_KEY,
+	TIMER_ONESHOT,
+	TIMER_MACRO_REPEAT,
+	TIMER_MACRO,
+
+	TIMER_MAX
+};
+
 struct cache_entry {
 	uint8_t code;
 	struct descriptor d;
@@ -27,18 +38,27 @@ struct cache_entry {
 struct key_event {
 	uint8_t code;
 	uint8_t pressed;
-	int timestamp;
+	int64_t timestamp; /* us */
 };
 
 struct output {
 	void (*send_key) (uint8_t code, uint8_t state);
 	void (*on_layer_change) (const struct keyboard *kbd, const char *name, uint8_t active);
+	void (*run_command) (const char *cmd);
 };
 
 /* May correspond to more than one physical input device. */
 struct keyboard {
+	/*
+	 * The config is shared with other keyboards. Modifications made by
+	 * kbd_eval() are applied to a private copy of the original config
+	 * (which may itself be replaced by kbd_set_base_config()), created on
+	 * demand and discarded on reset.
+	 */
+	const struct config *config;
 	const struct config *original_config;
-	struct config config;
+	struct config *private_config;
+
 	struct output output;
 
 	/*
@@ -47,6 +67,20 @@ struct keyboard {
 	 */
 	struct cache_entry cache[CACHE_SIZE];
 
+	/*
+	 * Lazily populated code->descriptor mappings for the current layer
+	 * state. An entry is only valid if its generation matches
+	 * keymap_generation, which is bumped whenever the layer state or the
+	 * config changes.
+	 */
+	struct {
+		struct descriptor d;
+		int dl;
+		uint32_t generation;
+	} keymap[256];
+
+	uint32_t keymap_generation;
+
 	uint8_t last_pressed_output_code;
 	uint8_t last_pressed_code;
 
@@ -54,19 +88,44 @@ struct keyboard {
 
 	uint8_t inhibit_modifier_guard;
 
-	struct macro *active_macro;
+	/*
+	 * References into the config are stored as indices so they remain
+	 * valid across config changes (see kbd_eval()).
+	 */
+
+	/* The index of the repeating macro in config->macros (-1 if none). */
+	int active_macro;
 	int active_macro_layer;
 	int overload_last_layer_code;
 
-	long macro_timeout;
-	long oneshot_timeout;
+	int64_t macro_timeout;
+	int64_t oneshot_timeout;
+
+	int64_t macro_repeat_interval;
+
+	/*
+	 * The macro currently being played back. Input received in the
+	 * meantime is queued until it has finished.
+	 */
+	struct macro_player macro_player;
+	int64_t macro_step_time;
+
+	struct key_event macro_queue[32];
+	size_t macro_queue_sz;
 
-	long macro_repeat_interval;
+	int64_t overload_start_time;
 
-	long overload_start_time;
+	/*
+	 * Pending timers stored as a binary min-heap ordered by expiry.
+	 * timer_pos holds the heap index of each timer (-1 if inactive).
+	 */
+	struct timer_entry {
+		int64_t expire;
+		enum timer id;
+	} timers[TIMER_MAX];
 
-	long timeouts[64];
-	size_t nr_timeouts; 
+	size_t nr_timers;
+	int timer_pos[TIMER_MAX];
 
 	struct active_chord {
 		uint8_t active;
@@ -78,11 +137,16 @@ struct keyboard {
 		struct key_event queue[32];
 		size_t queue_sz;
 
-		const struct chord *match;
+		/* The set of keys struck within the queue and the number of key down events. */
+		uint64_t queue_keymask[4];
+		size_t queue_npressed;
+
+		/* The index of the matching chord within match_layer (-1 if none). */
+		int match;
 		int match_layer;
 
 		uint8_t start_code;
-		long last_code_time;
+		int64_t last_code_time;
 
 		enum {
 			CHORD_RESOLVING,
@@ -95,8 +159,8 @@ struct keyboard {
 	struct {
 		uint8_t code;
 		uint8_t dl;
-		long expire;
-		long tap_expiry;
+		int64_t expire;
+		int64_t tap_expiry;
 
 		enum {
 			PK_INTERRUPT_ACTION1,
@@ -131,10 +195,12 @@ struct keyboard {
 	} scroll;
 };
 
-struct keyboard *new_keyboard(struct config *config, const struct output *output);
+struct keyboard *new_keyboard(const struct config *config, const struct output *output);
+void free_keyboard(struct keyboard *kbd);
 
-long kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n);
+int64_t kbd_process_events(struct keyboard *kbd, const struct key_event *events, size_t n);
 int kbd_eval(struct keyboard *kbd, const char *exp);
+void kbd_set_base_config(struct keyboard *kbd, const struct config *config);
 void kbd_reset(struct keyboard *kbd);
 
 #endif
@@ -6,35 +6,54 @@
 
 #include "keyd.h"
 
-static int ipc_exec(int type, const char *data, size_t sz, uint32_t timeout)
+/* Requests are pipelined over a single connection, opened on first use. */
+static int ipc_con()
 {
-	struct ipc_message msg;
+	static int con = -1;
 
-	assert(sz <= sizeof(msg.data));
+	if (con == -1)
+		con = ipc_connect();
 
-	msg.type = type;
-	msg.sz = sz;
-	msg.timeout = timeout;
-	memcpy(msg.data, data, sz);
+	return con;
+}
 
-	int con = ipc_connect();
+/* Sends a request, splitting its body across as many frames as necessary. */
+static void ipc_request(int type, const char *data, size_t sz, uint32_t timeout)
+{
+	int con = ipc_con();
 
-	if (con < 0) {
-		perror("connect");
-		exit(-1);
+	while (sz > MAX_IPC_FRAME_SIZE) {
+		ipc_send(con, type, IPC_MORE, timeout, data, MAX_IPC_FRAME_SIZE);
+
+		data += MAX_IPC_FRAME_SIZE;
+		sz -= MAX_IPC_FRAME_SIZE;
 	}
 
-	xwrite(con, &msg, sizeof msg);
-	xread(con, &msg, sizeof msg);
+	ipc_send(con, type, 0, timeout, data, sz);
+}
+
+/* Waits for the reply to the oldest outstanding request. */
+static int ipc_reply()
+{
+	struct ipc_header hdr;
+	char data[MAX_IPC_FRAME_SIZE+1];
+
+	if (ipc_recv(ipc_con(), &hdr, data))
+		die("failed to read reply from keyd");
 
-	if (msg.sz) {
-		xwrite(1, msg.data, msg.sz);
+	if (hdr.sz) {
+		xwrite(1, data, hdr.sz);
 		xwrite(1, "\n", 1);
 	}
 
-	return msg.type == IPC_FAIL;
+	return hdr.type == IPC_FAIL;
+}
+
+static int ipc_exec(int type, const char *data, size_t sz, uint32_t timeout)
+{
+	ipc_request(type, data, sz, timeout);
 
-	return type == IPC_FAIL;
+	return ipc_reply();
 }
 
 static int version(int argc, char *argv[])
@@ -51,8 +70,10 @@ static int help(int argc, char *argv[])
 	       "    monitor [-t]                   Print key events in real time.\n"
 	       "    list-keys                      Print a list of valid key names.\n"
 	       "    reload                         Trigger a reload .\n"
-	       "    listen                         Print layer state changes of the running keyd daemon to stdout.\n"
+	       "    listen [-s]                    Print layer state changes of the running keyd daemon to stdout.\n"
+	       "    trace [on|off|reset|dump]      Control latency tracing or print the collected latencies.\n"
 	       "    bind <binding> [<binding>...]  Add the supplied bindings to all loaded configs.\n"
+	       "    compile [<file>...]            Compile the supplied configs (default: all) into the cache.\n"
 	       "Options:\n"
 	       "    -v, --version      Print the current version and exit.\n"
 	       "    -h, --help         Print help and exit.\n");
@@ -86,8 +107,11 @@ static int add_bindings(int argc, char *argv[])
 	int i;
 	int ret = 0;
 
+	for (i = 1; i < argc; i++)
+		ipc_request(IPC_BIND, argv[i], strlen(argv[i]), 0);
+
 	for (i = 1; i < argc; i++) {
-		if (ipc_exec(IPC_BIND, argv[i], strlen(argv[i]), 0))
+		if (ipc_reply())
 			ret = -1;
 	}
 
@@ -144,11 +168,11 @@ static int cmd_do(int argc, char *argv[])
 }
 
 
+/* Text is streamed, so it is not subject to the size limit imposed on other requests. */
 static int input(int argc, char *argv[])
 {
-	char buf[MAX_IPC_MESSAGE_SIZE];
-	size_t sz = sizeof buf;
 	uint32_t timeout = 0;
+	int i;
 
 	if (argc > 2 && !strcmp(argv[1], "-t")) {
 		timeout = atoi(argv[2]);
@@ -156,24 +180,45 @@ static int input(int argc, char *argv[])
 		argv += 2;
 	}
 
-	read_input(argc-1, argv+1, buf, &sz);
+	if (argc > 1) {
+		for (i = 1; i < argc; i++) {
+			size_t sz = strlen(argv[i]);
+			const char *s = argv[i];
+
+			while (sz) {
+				size_t n = sz < MAX_IPC_FRAME_SIZE ? sz : MAX_IPC_FRAME_SIZE;
+
+				ipc_send(ipc_con(), IPC_INPUT, IPC_MORE, timeout, s, n);
 
-	return ipc_exec(IPC_INPUT, buf, sz, timeout);
+				s += n;
+				sz -= n;
+			}
+
+			if (i != argc-1)
+				ipc_send(ipc_con(), IPC_INPUT, IPC_MORE, timeout, " ", 1);
+		}
+	} else {
+		char buf[MAX_IPC_FRAME_SIZE];
+		ssize_t n;
+
+		while ((n = read(0, buf, sizeof buf)) > 0)
+			ipc_send(ipc_con(), IPC_INPUT, IPC_MORE, timeout, buf, n);
+	}
+
+	ipc_send(ipc_con(), IPC_INPUT, 0, timeout, NULL, 0);
+
+	return ipc_reply();
 }
 
 static int layer_listen(int argc, char *argv[])
 {
-	struct ipc_message msg = {0};
+	int con = ipc_con();
+	uint32_t flags = 0;
 
-	int con = ipc_connect();
-
-	if (con < 0) {
-		perror("connect");
-		exit(-1);
-	}
+	if (argc > 1 && !strcmp(argv[1], "-s"))
+		flags |= IPC_LISTEN_SEQ;
 
-	msg.type = IPC_LAYER_LISTEN;
-	xwrite(con, &msg, sizeof msg);
+	ipc_send(con, IPC_LAYER_LISTEN, flags, 0, NULL, 0);
 
 	while (1) {
 		char buf[512];
@@ -186,6 +231,107 @@ static int layer_listen(int argc, char *argv[])
 	}
 }
 
+/* Fetches the trace ring one frame at a time, resuming after the last record received. */
+static int dump_trace()
+{
+	unsigned long long seq = 0;
+	struct ipc_header hdr;
+	char data[MAX_IPC_FRAME_SIZE+1];
+
+	printf("# seq kernel_time key state input_us process_us output_us\n");
+	fflush(stdout);
+
+	do {
+		char req[64];
+		int n = snprintf(req, sizeof req, "dump %llu", seq);
+
+		ipc_request(IPC_TRACE, req, n, 0);
+
+		if (ipc_recv(ipc_con(), &hdr, data))
+			die("failed to read reply from keyd");
+
+		if (hdr.type == IPC_FAIL) {
+			fprintf(stderr, "%s\n", data);
+			return -1;
+		}
+
+		xwrite(1, data, hdr.sz);
+
+		if (hdr.sz) {
+			char *last = data + hdr.sz - 1;
+
+			while (last > data && last[-1] != '\n')
+				last--;
+
+			seq = strtoull(last, NULL, 10) + 1;
+		}
+	} while (hdr.flags & IPC_MORE);
+
+	return 0;
+}
+
+static int cmd_trace(int argc, char *argv[])
+{
+	if (argc < 2)
+		return ipc_exec(IPC_TRACE, NULL, 0, 0);
+
+	if (!strcmp(argv[1], "dump"))
+		return dump_trace();
+
+	return ipc_exec(IPC_TRACE, argv[1], strlen(argv[1]), 0);
+}
+
+static int compile(int argc, char *argv[])
+{
+	int i;
+	int ret = 0;
+
+	if (argc < 2) {
+		DIR *dh = opendir(CONFIG_DIR);
+		struct dirent *dirent;
+
+		if (!dh) {
+			perror("opendir");
+			return -1;
+		}
+
+		while ((dirent = readdir(dh))) {
+			char path[1024];
+			int len;
+
+			len = snprintf(path, sizeof path, "%s/%s", CONFIG_DIR, dirent->d_name);
+
+			if (dirent->d_type != DT_DIR && len >= 5 && !strcmp(path + len - 5, ".conf")) {
+				if (config_compile(path)) {
+					fprintf(stderr, "ERROR: %s: %s\n", path, errstr);
+					ret = -1;
+				} else {
+					printf("compiled %s\n", path);
+				}
+			}
+		}
+
+		closedir(dh);
+		return ret;
+	}
+
+	for (i = 1; i < argc; i++) {
+		char path[PATH_MAX];
+
+		if (!realpath(argv[i], path)) {
+			perror(argv[i]);
+			ret = -1;
+		} else if (config_compile(path)) {
+			fprintf(stderr, "ERROR: %s: %s\n", path, errstr);
+			ret = -1;
+		} else {
+			printf("compiled %s\n", path);
+		}
+	}
+
+	return ret;
+}
+
 static int reload()
 {
 	ipc_exec(IPC_RELOAD, NULL, 0, 0);
@@ -210,8 +356,10 @@ struct {
 	{"do", "", "", cmd_do},
 
 	{"listen", "", "", layer_listen},
+	{"trace", "", "", cmd_trace},
 
 	{"reload", "", "", reload},
+	{"compile", "", "", compile},
 	{"list-keys", "", "", list_keys},
 };
 
@@ -39,14 +39,26 @@
 
 #include "config.h"
 #include "macro.h"
+#include "input.h"
+#include "trace.h"
 #include "device.h"
 #include "log.h"
 #include "keyboard.h"
+#include "worker.h"
 #include "keys.h"
 #include "vkbd.h"
 #include "string.h"
 
 #define MAX_IPC_MESSAGE_SIZE 4096
+#define MAX_IPC_FRAME_SIZE 4096
+
+#define IPC_MAGIC 0x796b
+#define IPC_VERSION 1
+
+/* The request body continues in the next frame. */
+#define IPC_MORE 0x1
+/* Prefix layer changes sent to an IPC_LAYER_LISTEN client with sequence numbers. */
+#define IPC_LISTEN_SEQ 0x2
 
 #define ARRAY_SIZE(x) (int)(sizeof(x)/sizeof(x[0]))
 
@@ -62,33 +74,61 @@ enum event_type {
 struct event {
 	enum event_type type;
 	struct device *dev;
-	struct device_event *devev;
-	int timestamp;
+	const struct device_event *devevs;
+	size_t nr_devevs;
+	int64_t timestamp; /* us (CLOCK_MONOTONIC) */
 	int fd;
 };
 
-struct ipc_message {
-	enum {
-		IPC_SUCCESS,
-		IPC_FAIL,
-
-		IPC_BIND,
-		IPC_INPUT,
-		IPC_MACRO,
-		IPC_RELOAD,
-		IPC_LAYER_LISTEN,
-	} type;
-	
+enum ipc_type {
+	IPC_SUCCESS,
+	IPC_FAIL,
+
+	IPC_BIND,
+	IPC_INPUT,
+	IPC_MACRO,
+	IPC_RELOAD,
+	IPC_LAYER_LISTEN,
+
+	IPC_APP_RESET,
+	IPC_APP_ADD,
+	IPC_APP_FOCUS,
+
+	IPC_TRACE,
+};
+
+/*
+ * Every IPC frame consists of a header followed by sz bytes of body (at most
+ * MAX_IPC_FRAME_SIZE). Larger request bodies are split across several frames
+ * of the same type, all but the last of which carry IPC_MORE. Each request is
+ * answered by a single IPC_SUCCESS or IPC_FAIL frame (a reply carrying
+ * IPC_MORE indicates that further data can be requested), and a connection
+ * may carry any number of requests, which are executed in order.
+ */
+struct ipc_header {
+	uint16_t magic;
+	uint8_t version;
+	uint8_t type;
+	uint32_t flags;
 	uint32_t timeout;
-	char data[MAX_IPC_MESSAGE_SIZE];
-	size_t sz;
+	uint32_t sz;
 };
 
 int monitor(int argc, char *argv[]);
 int run_daemon(int argc, char *argv[]);
 
-void evloop_add_fd(int fd);
-int evloop(int (*event_handler) (struct event *ev));
+int evloop_add_fd(int fd);
+void evloop_remove_fd(int fd);
+void evloop_watch_output(int fd, int enabled);
+int evloop(int64_t (*event_handler) (struct event *ev));
+
+int runner_init();
+void runner_exec(const char *cmd);
+int runner_read();
+
+void realtime_init();
+
+int64_t get_time_us();
 
 void xwrite(int fd, const void *buf, size_t sz);
 void xread(int fd, void *buf, size_t sz);
@@ -96,6 +136,10 @@ void xread(int fd, void *buf, size_t sz);
 int ipc_create_server();
 int ipc_connect();
 
+size_t ipc_encode(void *buf, uint8_t type, uint32_t flags, uint32_t timeout, const void *data, size_t sz);
+void ipc_send(int con, uint8_t type, uint32_t flags, uint32_t timeout, const void *data, size_t sz);
+int ipc_recv(int con, struct ipc_header *hdr, char data[MAX_IPC_FRAME_SIZE+1]);
+
 extern struct device device_table[MAX_DEVICES];
 extern size_t device_table_sz;
 
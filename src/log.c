@@ -6,7 +6,7 @@
 #include "log.h"
 #include <time.h>
 
-char errstr[2048];
+_Thread_local char errstr[2048];
 
 int log_level = 0;
 int suppress_colours = 0;
@@ -15,7 +15,8 @@ static const char *colorize(const char *s)
 {
 	int i;
 
-	static char buf[1024];
+	/* Logging may take place on keyboard workers (see worker.h). */
+	static _Thread_local char buf[1024];
 	size_t n  = 0;
 	int inside_escape = 0;
 
@@ -23,6 +23,7 @@ void die(const char *fmt, ...);
 
 extern int log_level;
 extern int suppress_colours;
-extern char errstr[2048];
+/* Per thread, so configs can be parsed off the event loop (see daemon.c). */
+extern _Thread_local char errstr[2048];
 
 #endif
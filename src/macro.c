@@ -82,85 +82,108 @@ int macro_parse(char *s, struct macro *macro)
 	#undef ADD_ENTRY
 }
 
-void macro_execute(void (*output)(uint8_t, uint8_t),
-		   const struct macro *macro, size_t timeout)
+static void output_mods(void (*output)(uint8_t, uint8_t), uint8_t mods, uint8_t pressed)
 {
 	size_t i;
-	int hold_start = -1;
 
-	for (i = 0; i < macro->sz; i++) {
-		const struct macro_entry *ent = &macro->entries[i];
+	for (i = 0; i < ARRAY_SIZE(modifiers); i++) {
+		uint8_t code = modifiers[i].key;
+		uint8_t mask = modifiers[i].mask;
 
-		switch (ent->type) {
-			size_t j;
-			uint16_t idx;
-			uint8_t codes[4];
-			uint8_t code, mods;
+		if (mods & mask)
+			output(code, pressed);
+	}
+}
 
-		case MACRO_HOLD:
-			if (hold_start == -1)
-				hold_start = i;
+void macro_start(struct macro_player *player, const struct macro *macro, size_t timeout)
+{
+	player->macro = *macro;
+	player->timeout = timeout;
+	player->idx = 0;
+	player->hold_start = -1;
+	player->stage = MP_ENTRY;
+	player->active = 1;
+}
 
-			output(ent->data, 1);
+int64_t macro_step(struct macro_player *player, void (*output)(uint8_t, uint8_t))
+{
+	const struct macro *macro = &player->macro;
+	int64_t timeout = player->timeout;
 
-			break;
-		case MACRO_RELEASE:
-			if (hold_start != -1) {
-				size_t j;
+	while (player->active && player->idx < macro->sz) {
+		const struct macro_entry *ent = &macro->entries[player->idx];
 
-				for (j = hold_start; j < i; j++) {
-					const struct macro_entry *ent = &macro->entries[j];
-					output(ent->data, 0);
-				}
+		size_t j;
+		uint16_t idx;
+		uint8_t codes[4];
+		uint8_t code = ent->data;
+		uint8_t mods = ent->data >> 8;
 
-				hold_start = -1;
-			}
-			break;
-		case MACRO_UNICODE:
-			idx = ent->data;
+		switch (player->stage) {
+		case MP_ENTRY:
+			player->stage = MP_DELAY;
 
-			unicode_get_sequence(idx, codes);
+			switch (ent->type) {
+			case MACRO_HOLD:
+				if (player->hold_start == -1)
+					player->hold_start = player->idx;
 
-			for (j = 0; j < 4; j++) {
-				output(codes[j], 1);
-				output(codes[j], 0);
-			}
+				output(ent->data, 1);
 
-			break;
-		case MACRO_KEYSEQUENCE:
-			code = ent->data;
-			mods = ent->data >> 8;
+				break;
+			case MACRO_RELEASE:
+				if (player->hold_start != -1) {
+					for (j = player->hold_start; j < player->idx; j++)
+						output(macro->entries[j].data, 0);
 
-			for (j = 0; j < ARRAY_SIZE(modifiers); j++) {
-				uint8_t code = modifiers[j].key;
-				uint8_t mask = modifiers[j].mask;
+					player->hold_start = -1;
+				}
+				break;
+			case MACRO_UNICODE:
+				idx = ent->data;
 
-				if (mods & mask)
-					output(code, 1);
-			}
+				unicode_get_sequence(idx, codes);
 
-			if (mods && timeout)
-				usleep(timeout);
+				for (j = 0; j < 4; j++) {
+					output(codes[j], 1);
+					output(codes[j], 0);
+				}
 
-			output(code, 1);
-			output(code, 0);
+				break;
+			case MACRO_KEYSEQUENCE:
+				output_mods(output, mods, 1);
 
-			for (j = 0; j < ARRAY_SIZE(modifiers); j++) {
-				uint8_t code = modifiers[j].key;
-				uint8_t mask = modifiers[j].mask;
+				player->stage = MP_SEQUENCE;
+				if (mods && timeout)
+					return timeout;
 
-				if (mods & mask)
-					output(code, 0);
+				break;
+			case MACRO_TIMEOUT:
+				if (ent->data)
+					return ent->data * 1000LL;
+				break;
 			}
 
+			break;
+		case MP_SEQUENCE:
+			output(code, 1);
+			output(code, 0);
+
+			output_mods(output, mods, 0);
 
+			player->stage = MP_DELAY;
 			break;
-		case MACRO_TIMEOUT:
-			usleep(ent->data * 1E3);
+		case MP_DELAY:
+			player->stage = MP_ENTRY;
+			player->idx++;
+
+			if (timeout)
+				return timeout;
+
 			break;
 		}
-
-		if (timeout)
-			usleep(timeout);
 	}
+
+	player->active = 0;
+	return 0;
 }
@@ -27,9 +27,36 @@ struct macro {
 };
 
 
-void macro_execute(void (*output)(uint8_t, uint8_t),
-		   const struct macro *macro,
-		   size_t timeout);
+/*
+ * Playback state for a macro. The macro is executed incrementally by
+ * macro_step() so that pauses do not block the caller. A private copy
+ * of the macro is kept so the source may change during playback.
+ */
+struct macro_player {
+	struct macro macro;
+
+	/* Delay between entries in us. */
+	size_t timeout;
+
+	size_t idx;
+	int hold_start;
+
+	enum {
+		MP_ENTRY,
+		MP_SEQUENCE,
+		MP_DELAY,
+	} stage;
+
+	uint8_t active;
+};
+
+void macro_start(struct macro_player *player, const struct macro *macro, size_t timeout);
+
+/*
+ * Executes the macro up to its next pause and returns the length of the pause
+ * in us. Returns 0 once the macro has been completed.
+ */
+int64_t macro_step(struct macro_player *player, void (*output)(uint8_t, uint8_t));
 
 int macro_parse(char *s, struct macro *macro);
 #endif
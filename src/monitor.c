@@ -30,9 +30,10 @@ static void cleanup()
 	set_tflags(ICANON|ECHO, 1);
 }
 
-int event_handler(struct event *ev)
+int64_t event_handler(struct event *ev)
 {
-	static long last_time;
+	static int64_t last_time;
+	size_t i;
 
 	switch (ev->type) {
 	const char *name;
@@ -48,22 +49,29 @@ int event_handler(struct event *ev)
 			  ev->dev->name, ev->dev->path);
 		break;
 	case EV_DEV_EVENT:
-		switch (ev->devev->type) {
-		case DEV_KEY:
-			name = keycode_table[ev->devev->code].name;
-
-			if (time_flag)
-				keyd_log("r{+%ld} ms\t", ev->timestamp - last_time);
-
-			keyd_log("%s\t%04x:%04x\t%s %s\n",
-				 ev->dev->name,
-				 ev->dev->vendor_id,
-				 ev->dev->product_id, name,
-				 ev->devev->pressed ? "down" : "up");
-
-			break;
-		default:
-			break;
+		for (i = 0; i < ev->nr_devevs; i++) {
+			const struct device_event *devev = &ev->devevs[i];
+
+			switch (devev->type) {
+			case DEV_KEY:
+				name = keycode_table[devev->code].name;
+
+				/* Use the kernel's timestamps so recordings reflect the actual timing. */
+				if (time_flag)
+					keyd_log("r{+%ld} ms\t", last_time ? (long)((devev->timestamp - last_time) / 1000) : 0L);
+
+				last_time = devev->timestamp;
+
+				keyd_log("%s\t%04x:%04x\t%s %s\n",
+					 ev->dev->name,
+					 ev->dev->vendor_id,
+					 ev->dev->product_id, name,
+					 devev->pressed ? "down" : "up");
+
+				break;
+			default:
+				break;
+			}
 		}
 		break;
 	case EV_FD_ERR:
@@ -76,7 +84,6 @@ int event_handler(struct event *ev)
 	fflush(stdout);
 	fflush(stderr);
 
-	last_time = ev->timestamp;
 	return 0;
 }
 
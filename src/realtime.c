@@ -0,0 +1,232 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+
+/* For sched_setaffinity() and friends. */
+#define _GNU_SOURCE
+
+#include "keyd.h"
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#ifdef __GLIBC__
+	#include <malloc.h>
+#endif
+
+/*
+ * Opt-in low latency mode, enabled by KEYD_REALTIME and KEYD_CPUS (see
+ * keyd(1)). Every step is attempted independently and a failure is only
+ * reported, since a partially applied mode is still preferable to none.
+ *
+ * This must be called before any configs are loaded (so that their memory
+ * is locked as it is allocated) and after the command runner has been
+ * forked (so that commands do not inherit the scheduling policy). Workers
+ * inherit the policy and affinity of the event loop.
+ */
+
+#define DEFAULT_PRIORITY 50
+
+/* Enough for the deepest path through the event loop. */
+#define STACK_PREFAULT_SIZE (256 * 1024)
+
+static int parse_policy(const char *s, int *policy, int *priority)
+{
+	char *end;
+
+	if (!strncmp(s, "fifo", 4)) {
+		*policy = SCHED_FIFO;
+		s += 4;
+	} else if (!strncmp(s, "rr", 2)) {
+		*policy = SCHED_RR;
+		s += 2;
+	} else {
+		return -1;
+	}
+
+	*priority = DEFAULT_PRIORITY;
+
+	if (!*s)
+		return 0;
+
+	if (*s++ != ':')
+		return -1;
+
+	*priority = strtol(s, &end, 10);
+
+	if (end == s || *end ||
+	    *priority < sched_get_priority_min(*policy) ||
+	    *priority > sched_get_priority_max(*policy))
+		return -1;
+
+	return 0;
+}
+
+/* Parses a list of the form "0,2-3". */
+static int parse_cpus(const char *s, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+
+	while (*s) {
+		char *end;
+		long first = strtol(s, &end, 10);
+		long last = first;
+
+		if (end == s)
+			return -1;
+
+		if (*end == '-') {
+			s = end + 1;
+			last = strtol(s, &end, 10);
+
+			if (end == s)
+				return -1;
+		}
+
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+
+		s = end;
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -1;
+	}
+
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+static void __attribute__((noinline)) prefault_stack()
+{
+	volatile char buf[STACK_PREFAULT_SIZE];
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	for (i = 0; i < sizeof buf; i += pagesz)
+		buf[i] = 0;
+}
+
+/* Returns the amount of locked memory in kB (or -1 if unknown). */
+static long locked_memory()
+{
+	char line[256];
+	long kb = -1;
+	FILE *fh = fopen("/proc/self/status", "r");
+
+	if (!fh)
+		return -1;
+
+	while (fgets(line, sizeof line, fh))
+		if (sscanf(line, "VmLck: %ld kB", &kb) == 1)
+			break;
+
+	fclose(fh);
+	return kb;
+}
+
+static void set_scheduler(int policy, int priority)
+{
+	struct sched_param param = {0};
+	struct rlimit rl;
+
+	param.sched_priority = priority;
+
+	if (sched_setscheduler(0, policy, &param)) {
+		keyd_log("REALTIME: y{WARNING} failed to set %s scheduling: %s",
+			 policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", strerror(errno));
+
+		if (!getrlimit(RLIMIT_RTPRIO, &rl) && rl.rlim_cur < (rlim_t)priority)
+			keyd_log(" (RLIMIT_RTPRIO is %ld)", (long)rl.rlim_cur);
+
+		keyd_log("\n");
+		return;
+	}
+
+	/* Verify that the policy has actually been applied. */
+	if (sched_getscheduler(0) != policy || sched_getparam(0, &param) || param.sched_priority != priority) {
+		keyd_log("REALTIME: y{WARNING} scheduling policy was not applied\n");
+	} else {
+		keyd_log("REALTIME: g{ok}  %s scheduling (priority %d)\n",
+			 policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", priority);
+	}
+}
+
+static void lock_memory()
+{
+	struct rlimit rl;
+	long kb;
+
+	/*
+	 * MCL_CURRENT also faults in the large static buffers (e.g. those
+	 * used by the config parser), while MCL_FUTURE causes memory
+	 * allocated later on to be faulted in as it is mapped.
+	 */
+#ifdef __GLIBC__
+	/* Keep freed memory mapped (and therefore locked) for reuse. */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+#endif
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		keyd_log("REALTIME: y{WARNING} failed to lock memory: %s", strerror(errno));
+
+		if (!getrlimit(RLIMIT_MEMLOCK, &rl) && rl.rlim_cur != RLIM_INFINITY)
+			keyd_log(" (RLIMIT_MEMLOCK is %ld kB)", (long)rl.rlim_cur / 1024);
+
+		keyd_log("\n");
+		return;
+	}
+
+	prefault_stack();
+
+	if ((kb = locked_memory()) >= 0) {
+		keyd_log("REALTIME: g{ok}  memory locked (%ld kB)\n", kb);
+	} else {
+		keyd_log("REALTIME: g{ok}  memory locked\n");
+	}
+}
+
+static void set_affinity(const char *s)
+{
+	cpu_set_t set;
+
+	if (parse_cpus(s, &set)) {
+		keyd_log("REALTIME: r{ERROR:} invalid cpu list \"%s\"\n", s);
+		return;
+	}
+
+	if (sched_setaffinity(0, sizeof set, &set) ||
+	    sched_getaffinity(0, sizeof set, &set)) {
+		keyd_log("REALTIME: y{WARNING} failed to set cpu affinity: %s\n", strerror(errno));
+		return;
+	}
+
+	keyd_log("REALTIME: g{ok}  running on %d cpu(s) (%s)\n", CPU_COUNT(&set), s);
+}
+
+void realtime_init()
+{
+	const char *s = getenv("KEYD_REALTIME");
+	const char *cpus = getenv("KEYD_CPUS");
+	int policy;
+	int priority;
+
+	if (cpus && *cpus)
+		set_affinity(cpus);
+
+	if (!s || !*s)
+		return;
+
+	if (parse_policy(s, &policy, &priority)) {
+		keyd_log("REALTIME: r{ERROR:} invalid policy \"%s\" (expected fifo[:<priority>] or rr[:<priority>])\n", s);
+		return;
+	}
+
+	lock_memory();
+	set_scheduler(policy, priority);
+}
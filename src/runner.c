@@ -0,0 +1,338 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+
+#include "keyd.h"
+#include <spawn.h>
+#include <stddef.h>
+
+/*
+ * Commands are executed by a helper process which is forked before the daemon
+ * loads any configs or raises its priority. Requests are written to it over a
+ * pipe and never block the daemon; the helper spawns each command with a
+ * fixed environment and reports its exit status once it has been reaped.
+ *
+ * Every message is smaller than PIPE_BUF, so writes are atomic.
+ */
+
+#define MAX_COMMAND_SIZE sizeof(struct command)
+
+struct runner_request {
+	uint32_t id;
+	uint32_t sz;
+	char cmd[MAX_COMMAND_SIZE];
+};
+
+struct runner_status {
+	uint32_t id;
+	int32_t pid;
+	int32_t status;
+};
+
+struct job {
+	pid_t pid;
+	uint32_t id;
+};
+
+static pid_t runner_pid;
+static int reqfd = -1;
+static int statusfd = -1;
+static uint32_t next_id = 1;
+
+static int sigpipe[2];
+
+static void on_sigchld(int sig)
+{
+	int saved = errno;
+
+	(void)sig;
+
+	/* The pipe is non-blocking, a full pipe already guarantees a wakeup. */
+	if (write(sigpipe[1], "", 1) < 0) {}
+	errno = saved;
+}
+
+static void build_env(char *env[4], char buf[3][PATH_MAX])
+{
+	const char *path = getenv("PATH");
+	const char *home = getenv("HOME");
+	const char *lang = getenv("LANG");
+	size_t n = 0;
+
+	snprintf(buf[n], PATH_MAX, "PATH=%s", path ? path : "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin");
+	env[n] = buf[n];
+	n++;
+
+	snprintf(buf[n], PATH_MAX, "HOME=%s", home ? home : "/");
+	env[n] = buf[n];
+	n++;
+
+	if (lang) {
+		snprintf(buf[n], PATH_MAX, "LANG=%s", lang);
+		env[n] = buf[n];
+		n++;
+	}
+
+	env[n] = NULL;
+}
+
+static void reap(struct job *jobs, size_t *nr_jobs, int outfd)
+{
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		size_t i;
+
+		for (i = 0; i < *nr_jobs; i++) {
+			if (jobs[i].pid == pid) {
+				struct runner_status st = {
+					.id = jobs[i].id,
+					.pid = pid,
+					.status = status,
+				};
+
+				/* The daemon may be gone, in which case we exit on EOF. */
+				if (write(outfd, &st, sizeof st) < 0) {}
+
+				jobs[i] = jobs[--(*nr_jobs)];
+				break;
+			}
+		}
+	}
+}
+
+static void runner_main(int infd, int outfd)
+{
+	struct job jobs[64];
+	size_t nr_jobs = 0;
+
+	char envbuf[3][PATH_MAX];
+	char *env[4];
+
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t mask;
+
+	struct sigaction sa = {0};
+
+	build_env(env, envbuf);
+
+	if (pipe(sigpipe) < 0) {
+		perror("pipe");
+		exit(-1);
+	}
+
+	fcntl(sigpipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(sigpipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(sigpipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(sigpipe[1], F_SETFD, FD_CLOEXEC);
+
+	sa.sa_handler = on_sigchld;
+	sa.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	/* Terminal signals are handled by the daemon, which closes the pipe on exit. */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+	sigemptyset(&mask);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	while (1) {
+		struct pollfd pfds[] = {
+			{.fd = infd, .events = POLLIN},
+			{.fd = sigpipe[0], .events = POLLIN},
+		};
+
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			exit(-1);
+		}
+
+		if (pfds[1].revents) {
+			char buf[64];
+
+			while (read(sigpipe[0], buf, sizeof buf) > 0) {}
+			reap(jobs, &nr_jobs, outfd);
+		}
+
+		if (pfds[0].revents) {
+			struct runner_request req;
+			char *argv[] = {"/bin/sh", "-c", req.cmd, NULL};
+			ssize_t n;
+			pid_t pid;
+			int ret;
+
+			/*
+			 * Pipes do not preserve message boundaries, but since each
+			 * request was written atomically its body is guaranteed
+			 * to follow the header.
+			 */
+			n = read(infd, &req, offsetof(struct runner_request, cmd));
+
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			/* The daemon has exited. */
+			if (n <= 0)
+				exit(0);
+
+			if (req.sz >= MAX_COMMAND_SIZE)
+				exit(-1);
+
+			xread(infd, req.cmd, req.sz);
+			req.cmd[req.sz] = 0;
+
+			if (nr_jobs == ARRAY_SIZE(jobs)) {
+				struct runner_status st = { .id = req.id, .pid = -1, .status = EAGAIN };
+
+				if (write(outfd, &st, sizeof st) < 0) {}
+				continue;
+			}
+
+			ret = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, env);
+
+			if (ret) {
+				struct runner_status st = { .id = req.id, .pid = -1, .status = ret };
+
+				if (write(outfd, &st, sizeof st) < 0) {}
+				continue;
+			}
+
+			jobs[nr_jobs].pid = pid;
+			jobs[nr_jobs].id = req.id;
+			nr_jobs++;
+		}
+	}
+}
+
+/*
+ * Forks the command runner and returns a descriptor which becomes readable
+ * whenever a command exits (see runner_read()). Must be called before the
+ * daemon opens any other descriptors or changes its priority, since both are
+ * inherited by the runner.
+ */
+int runner_init()
+{
+	int req[2];
+	int status[2];
+	pid_t pid;
+
+	if (pipe(req) < 0 || pipe(status) < 0) {
+		perror("pipe");
+		exit(-1);
+	}
+
+	pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		exit(-1);
+	}
+
+	if (!pid) {
+		close(req[1]);
+		close(status[0]);
+
+		/* Not to be inherited by the commands themselves. */
+		fcntl(req[0], F_SETFD, FD_CLOEXEC);
+		fcntl(status[1], F_SETFD, FD_CLOEXEC);
+
+		runner_main(req[0], status[1]);
+		exit(0);
+	}
+
+	close(req[0]);
+	close(status[1]);
+
+	runner_pid = pid;
+	reqfd = req[1];
+	statusfd = status[0];
+
+	fcntl(reqfd, F_SETFL, O_NONBLOCK);
+	fcntl(statusfd, F_SETFL, O_NONBLOCK);
+	fcntl(reqfd, F_SETFD, FD_CLOEXEC);
+	fcntl(statusfd, F_SETFD, FD_CLOEXEC);
+
+	return statusfd;
+}
+
+/* Queues the given shell command for execution without blocking. */
+void runner_exec(const char *cmd)
+{
+	struct runner_request req;
+	size_t len = strlen(cmd);
+	size_t sz;
+
+	if (reqfd == -1) {
+		keyd_log("r{ERROR:} command runner is not available, ignoring: %s\n", cmd);
+		return;
+	}
+
+	if (len >= MAX_COMMAND_SIZE)
+		len = MAX_COMMAND_SIZE - 1;
+
+	req.id = next_id++;
+	req.sz = len;
+	memcpy(req.cmd, cmd, len);
+
+	sz = offsetof(struct runner_request, cmd) + len;
+
+	if (write(reqfd, &req, sz) != (ssize_t)sz) {
+		keyd_log("r{ERROR:} failed to dispatch command: %s\n",
+			 errno == EAGAIN ? "runner is busy" : strerror(errno));
+		return;
+	}
+
+	dbg("executing command #%u: %s", req.id, cmd);
+}
+
+/*
+ * Collects the exit statuses of completed commands. Returns -1 if the runner
+ * has exited, after which commands are no longer executed.
+ */
+int runner_read()
+{
+	struct runner_status st;
+	ssize_t n;
+
+	while ((n = read(statusfd, &st, sizeof st)) == sizeof st) {
+		if (st.pid == -1) {
+			keyd_log("r{ERROR:} failed to execute command #%u: %s\n", st.id, strerror(st.status));
+		} else if (WIFEXITED(st.status)) {
+			dbg("command #%u (pid %d) exited with status %d", st.id, st.pid, WEXITSTATUS(st.status));
+		} else if (WIFSIGNALED(st.status)) {
+			dbg("command #%u (pid %d) was killed by signal %d", st.id, st.pid, WTERMSIG(st.status));
+		}
+	}
+
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+		keyd_log("r{ERROR:} command runner exited unexpectedly\n");
+
+		waitpid(runner_pid, NULL, 0);
+		close(reqfd);
+		close(statusfd);
+		reqfd = -1;
+		statusfd = -1;
+
+		return -1;
+	}
+
+	return 0;
+}
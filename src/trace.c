@@ -0,0 +1,271 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+
+#include "keyd.h"
+#include <stdatomic.h>
+
+/*
+ * Records are written by the event loop alone and published by advancing
+ * head, so readers never block the writer. A reader copies a record and
+ * then checks that head has not since moved far enough for the record to
+ * have been overwritten (the writer runs at most one batch ahead of head).
+ *
+ * Each stage is summarized by a log-linear histogram (in the style of
+ * HdrHistogram) with 16 sub-buckets per power of two, which bounds the
+ * error of reported percentiles to ~6%.
+ */
+
+#define RING_SIZE 4096
+
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define NR_BUCKETS (64 * SUB_BUCKETS)
+
+enum stage {
+	STAGE_INPUT,
+	STAGE_PROCESS,
+	STAGE_OUTPUT,
+	STAGE_TOTAL,
+
+	NR_STAGES
+};
+
+static const char *stage_names[] = {
+	"input",
+	"process",
+	"output",
+	"total",
+};
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[NR_BUCKETS];
+};
+
+int trace_enabled = 0;
+
+static struct trace_record ring[RING_SIZE];
+static _Atomic uint64_t head;
+
+static struct histogram histograms[NR_STAGES];
+
+/* Records belonging to the current event loop cycle. */
+static struct trace_record pending[MAX_DEVICE_EVENTS];
+static size_t nr_pending;
+static size_t nr_processed;
+
+static size_t bucket_index(uint64_t v)
+{
+	int msb;
+	int shift;
+
+	if (v < 2 * SUB_BUCKETS)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - SUB_BITS;
+
+	return (shift + 1) * SUB_BUCKETS + ((v >> shift) - SUB_BUCKETS);
+}
+
+/* Returns the largest value which maps to the given bucket. */
+static uint64_t bucket_value(size_t idx)
+{
+	int shift;
+	uint64_t m;
+
+	if (idx < 2 * SUB_BUCKETS)
+		return idx;
+
+	shift = idx / SUB_BUCKETS - 1;
+	m = SUB_BUCKETS + idx % SUB_BUCKETS;
+
+	return ((m + 1) << shift) - 1;
+}
+
+/* Stages stamped by different clock reads may appear marginally out of order. */
+static uint64_t elapsed(uint64_t start, uint64_t end)
+{
+	return end > start ? end - start : 0;
+}
+
+static void record(enum stage stage, uint64_t start, uint64_t end)
+{
+	struct histogram *h = &histograms[stage];
+	uint64_t v = elapsed(start, end);
+
+	h->count++;
+	h->sum += v;
+	h->buckets[bucket_index(v)]++;
+
+	if (v > h->max)
+		h->max = v;
+}
+
+static uint64_t percentile(const struct histogram *h, double p)
+{
+	uint64_t target = h->count * p / 100;
+	uint64_t n = 0;
+	size_t i;
+
+	for (i = 0; i < NR_BUCKETS; i++) {
+		n += h->buckets[i];
+
+		if (n > target)
+			return bucket_value(i) < h->max ? bucket_value(i) : h->max;
+	}
+
+	return h->max;
+}
+
+void trace_enable(int enabled)
+{
+	trace_enabled = enabled;
+	nr_pending = 0;
+	nr_processed = 0;
+}
+
+void trace_reset()
+{
+	memset(histograms, 0, sizeof histograms);
+}
+
+void trace_event(uint8_t code, uint8_t pressed, uint64_t kernel, uint64_t dispatch)
+{
+	struct trace_record *rec;
+
+	if (!trace_enabled || nr_pending == ARRAY_SIZE(pending))
+		return;
+
+	rec = &pending[nr_pending++];
+
+	rec->code = code;
+	rec->pressed = pressed;
+	rec->kernel = kernel;
+	rec->dispatch = dispatch;
+}
+
+void trace_processed()
+{
+	uint64_t now;
+
+	if (!trace_enabled || nr_processed == nr_pending)
+		return;
+
+	now = get_time_us();
+
+	while (nr_processed < nr_pending)
+		pending[nr_processed++].processed = now;
+}
+
+void trace_commit(int deferred)
+{
+	uint64_t seq = atomic_load_explicit(&head, memory_order_relaxed);
+	uint64_t now;
+	size_t i;
+
+	if (!trace_enabled || !nr_pending)
+		return;
+
+	trace_processed();
+
+	/* Wait for the flush which actually writes the output. */
+	if (deferred)
+		return;
+
+	now = get_time_us();
+
+	for (i = 0; i < nr_pending; i++) {
+		struct trace_record *rec = &pending[i];
+
+		rec->written = now;
+		rec->seq = seq;
+
+		record(STAGE_INPUT, rec->kernel, rec->dispatch);
+		record(STAGE_PROCESS, rec->dispatch, rec->processed);
+		record(STAGE_OUTPUT, rec->processed, rec->written);
+		record(STAGE_TOTAL, rec->kernel, rec->written);
+
+		ring[seq % RING_SIZE] = *rec;
+		seq++;
+	}
+
+	atomic_store_explicit(&head, seq, memory_order_release);
+
+	nr_pending = 0;
+	nr_processed = 0;
+}
+
+size_t trace_summary(char *buf, size_t sz)
+{
+	size_t n = 0;
+	size_t i;
+
+	n += snprintf(buf + n, sz - n, "%s, %llu events (times in us)\n\n%-8s %8s %8s %8s %8s %8s %8s\n",
+		      trace_enabled ? "enabled" : "disabled",
+		      (unsigned long long)histograms[STAGE_TOTAL].count,
+		      "stage", "p50", "p90", "p99", "p99.9", "max", "mean");
+
+	for (i = 0; i < NR_STAGES && n < sz; i++) {
+		const struct histogram *h = &histograms[i];
+
+		n += snprintf(buf + n, sz - n, "%-8s %8llu %8llu %8llu %8llu %8llu %8llu\n",
+			      stage_names[i],
+			      (unsigned long long)percentile(h, 50),
+			      (unsigned long long)percentile(h, 90),
+			      (unsigned long long)percentile(h, 99),
+			      (unsigned long long)percentile(h, 99.9),
+			      (unsigned long long)h->max,
+			      (unsigned long long)(h->count ? h->sum / h->count : 0));
+	}
+
+	/* Omit the trailing newline. */
+	return n < sz ? n - 1 : sz - 1;
+}
+
+uint64_t trace_dump(char *buf, size_t sz, size_t *len, uint64_t seq, uint64_t *phead)
+{
+	uint64_t end = atomic_load_explicit(&head, memory_order_acquire);
+
+	*len = 0;
+	*phead = end;
+
+	/* Start from the oldest record which cannot be overwritten by the next batch. */
+	if (seq > end || end - seq > RING_SIZE - MAX_DEVICE_EVENTS)
+		seq = end > RING_SIZE - MAX_DEVICE_EVENTS ? end - (RING_SIZE - MAX_DEVICE_EVENTS) : 0;
+
+	while (seq < end) {
+		struct trace_record rec = ring[seq % RING_SIZE];
+		char line[128];
+		int n;
+
+		/* Overwritten while we were reading it. */
+		if (atomic_load_explicit(&head, memory_order_acquire) + MAX_DEVICE_EVENTS - seq > RING_SIZE) {
+			seq++;
+			continue;
+		}
+
+		n = snprintf(line, sizeof line, "%llu %llu %s %s %llu %llu %llu\n",
+			     (unsigned long long)rec.seq,
+			     (unsigned long long)rec.kernel,
+			     KEY_NAME(rec.code),
+			     rec.pressed ? "down" : "up",
+			     (unsigned long long)elapsed(rec.kernel, rec.dispatch),
+			     (unsigned long long)elapsed(rec.dispatch, rec.processed),
+			     (unsigned long long)elapsed(rec.processed, rec.written));
+
+		if (*len + n > sz)
+			break;
+
+		memcpy(buf + *len, line, n);
+		*len += n;
+		seq++;
+	}
+
+	return seq;
+}
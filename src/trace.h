@@ -0,0 +1,63 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Optional latency tracing. When enabled, every key event is timestamped as
+ * it passes through each stage of the daemon:
+ *
+ *	kernel     - the time the kernel received the event (from evdev)
+ *	dispatch   - the time the event loop picked it up
+ *	processed  - the time the keyboard state machine finished with it
+ *	written    - the time the resulting output was written to the vkbd
+ *
+ * Output held back by the vkbd (see vkbd_flush()) is only considered written
+ * once the queue has been drained, so the records of a cycle whose output is
+ * deferred stay pending until then.
+ *
+ * Completed records are kept in a fixed size ring and summarized by a set
+ * of per-stage histograms. All times are in microseconds.
+ */
+
+struct trace_record {
+	uint64_t seq;
+
+	uint64_t kernel;
+	uint64_t dispatch;
+	uint64_t processed;
+	uint64_t written;
+
+	uint8_t code;
+	uint8_t pressed;
+};
+
+extern int trace_enabled;
+
+void trace_enable(int enabled);
+void trace_reset();
+
+/*
+ * Called by the event loop for each key event, after the keyboard has
+ * processed a batch and after the resulting output has been flushed.
+ * deferred should be set if vkbd_flush() held back some of the output.
+ */
+void trace_event(uint8_t code, uint8_t pressed, uint64_t kernel, uint64_t dispatch);
+void trace_processed();
+void trace_commit(int deferred);
+
+/*
+ * Formats the percentile summary or the records starting at the given
+ * sequence number into buf. The latter returns the sequence number of the
+ * next record, which is equal to *head once the ring has been exhausted.
+ */
+size_t trace_summary(char *buf, size_t sz);
+uint64_t trace_dump(char *buf, size_t sz, size_t *len, uint64_t seq, uint64_t *head);
+
+#endif
@@ -1,5 +1,17 @@
 #include "keyd.h"
 
+/*
+ * Microseconds on CLOCK_MONOTONIC, the clock input devices are switched to
+ * (see device.c), so event timestamps can be compared against it directly.
+ */
+int64_t get_time_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
 void xwrite(int fd, const void *buf, size_t sz)
 {
 	size_t nwr = 0;
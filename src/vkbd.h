@@ -12,6 +12,17 @@ struct vkbd;
 
 struct vkbd *vkbd_init(const char *name);
 
+/*
+ * Output generated between vkbd_begin() and vkbd_flush() is queued and
+ * written out in as few syscalls as possible when the latter is called.
+ *
+ * vkbd_flush() never blocks. If some of the output must be held back to
+ * preserve ordering, it returns the time (in us) after which it should be
+ * called again, and subsequent output is queued until then.
+ */
+void vkbd_begin(const struct vkbd *vkbd);
+int vkbd_flush(const struct vkbd *vkbd);
+
 void vkbd_mouse_move(const struct vkbd *vkbd, int x, int y);
 void vkbd_mouse_move_abs(const struct vkbd *vkbd, int x, int y);
 void vkbd_mouse_scroll(const struct vkbd *vkbd, int x, int y);
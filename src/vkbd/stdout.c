@@ -22,6 +22,15 @@ struct vkbd *vkbd_init(const char *name)
 	return NULL;
 }
 
+void vkbd_begin(const struct vkbd *vkbd)
+{
+}
+
+int vkbd_flush(const struct vkbd *vkbd)
+{
+	return 0;
+}
+
 void vkbd_mouse_scroll(const struct vkbd *vkbd, int x, int y)
 {
 	printf("mouse scroll: x: %d, y: %d\n", x, y);
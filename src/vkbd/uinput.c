@@ -145,32 +145,175 @@ static int create_virtual_pointer(const char *name)
 	return fd;
 }
 
+/*
+ * Output is accumulated in a single ordered queue and written out by
+ * flush_queue(), which issues one write() per run of events destined for the
+ * same device. Outside of a batch (see vkbd_begin()) the queue is flushed
+ * after every call.
+ *
+ * Events are grouped into frames terminated by SYN_REPORT. A frame is closed
+ * when output switches devices or when a key already present in the current
+ * frame is about to be changed again, since consumers are not guaranteed to
+ * observe more than one transition of the same key within a single report.
+ */
+
+/* The queue grows (and is never shrunk) to hold the output of a batch. */
+#define INITIAL_QUEUE_SIZE 512
+
+/*
+ * Buttons are routed through a separate device, so a click which immediately
+ * follows keyboard output (e.g a modified click) may be read by the consumer
+ * before the preceding key events. To prevent this, pointer buttons are held
+ * back until keyboard output has been given FENCE_TIME us to propagate.
+ * Since this only applies while keyboard events are actually in flight,
+ * isolated clicks incur no additional latency.
+ */
+#define FENCE_TIME 1000
+
+static struct {
+	struct input_event *events;
+	int *fds;
+	size_t sz;
+	size_t cap;
+
+	/* The device associated with the currently open frame (-1 if none). */
+	int frame_fd;
+	uint8_t frame_keys[KEY_CNT / 8];
+
+	int batch;
+
+	int kbd_fd;
+	int64_t last_kbd_write;
+} queue = { .frame_fd = -1, .kbd_fd = -1 };
+
+/*
+ * Write out as much of the queue as the fence allows. If force is set, the
+ * fence is ignored (used on teardown). Returns the time in us after which
+ * the remaining events may be written (0 if the queue has been emptied).
+ */
+static long flush_queue(int force)
+{
+	size_t i = 0;
+	long wait = 0;
+
+	while (i < queue.sz) {
+		size_t j;
+		size_t n = 1;
+		int fd = queue.fds[i];
+		int has_btn = 0;
+
+		while (i + n < queue.sz && queue.fds[i + n] == fd)
+			n++;
+
+		for (j = i; j < i + n; j++)
+			if (queue.events[j].type == EV_KEY)
+				has_btn = 1;
+
+		if (fd != queue.kbd_fd && has_btn) {
+			int64_t elapsed = get_time_us() - queue.last_kbd_write;
+
+			if (elapsed < FENCE_TIME && !force) {
+				wait = FENCE_TIME - elapsed;
+				break;
+			}
+		}
+
+		xwrite(fd, &queue.events[i], n * sizeof(struct input_event));
+
+		if (fd == queue.kbd_fd)
+			queue.last_kbd_write = get_time_us();
+
+		i += n;
+	}
+
+	queue.sz -= i;
+	memmove(queue.events, queue.events + i, queue.sz * sizeof(queue.events[0]));
+	memmove(queue.fds, queue.fds + i, queue.sz * sizeof(queue.fds[0]));
+
+	return wait;
+}
+
+static void queue_event(int fd, uint16_t type, uint16_t code, int value)
+{
+	struct input_event *ev;
+
+	if (queue.sz == queue.cap) {
+		queue.cap = queue.cap ? queue.cap * 2 : INITIAL_QUEUE_SIZE;
+		queue.events = realloc(queue.events, queue.cap * sizeof(queue.events[0]));
+		queue.fds = realloc(queue.fds, queue.cap * sizeof(queue.fds[0]));
+
+		if (!queue.events || !queue.fds) {
+			perror("realloc");
+			exit(-1);
+		}
+	}
+
+	ev = &queue.events[queue.sz];
+
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+	ev->time.tv_sec = 0;
+	ev->time.tv_usec = 0;
+
+	queue.fds[queue.sz++] = fd;
+}
+
+static void close_frame()
+{
+	if (queue.frame_fd == -1)
+		return;
+
+	queue_event(queue.frame_fd, EV_SYN, SYN_REPORT, 0);
+
+	queue.frame_fd = -1;
+	memset(queue.frame_keys, 0, sizeof queue.frame_keys);
+}
+
+static void open_frame(int fd)
+{
+	if (queue.frame_fd != fd)
+		close_frame();
+
+	queue.frame_fd = fd;
+}
+
+/*
+ * Terminates the current frame and writes out the queue if not batching. Held
+ * back events remain queued (along with any subsequent output) until the next
+ * vkbd_flush().
+ */
+static void commit()
+{
+	if (queue.batch)
+		return;
+
+	close_frame();
+	if (flush_queue(0))
+		queue.batch = 1;
+}
+
 static void write_key_event(const struct vkbd *vkbd, uint8_t code, int state)
 {
-	static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-	struct input_event ev;
+	uint16_t evcode;
 	int fd;
 	int is_btn;
 
-	pthread_mutex_lock(&mtx);
-
 	fd = vkbd->fd;
 
-	ev.type = EV_KEY;
-
 	is_btn = 1;
 	switch (code) {
-		case KEYD_LEFT_MOUSE:	 ev.code = BTN_LEFT; break;
-		case KEYD_MIDDLE_MOUSE:	 ev.code = BTN_MIDDLE; break;
-		case KEYD_RIGHT_MOUSE:	 ev.code = BTN_RIGHT; break;
-		case KEYD_MOUSE_1:	 ev.code = BTN_SIDE; break;
-		case KEYD_MOUSE_2:	 ev.code = BTN_EXTRA; break;
-		case KEYD_MOUSE_BACK:	 ev.code = BTN_BACK; break;
-		case KEYD_MOUSE_FORWARD: ev.code = BTN_FORWARD; break;
-		case KEYD_ZOOM:		 ev.code = KEY_ZOOM; is_btn = 0; break;
-		case KEYD_VOICECOMMAND: ev.code = KEY_VOICECOMMAND; is_btn = 0; break;
+		case KEYD_LEFT_MOUSE:	 evcode = BTN_LEFT; break;
+		case KEYD_MIDDLE_MOUSE:	 evcode = BTN_MIDDLE; break;
+		case KEYD_RIGHT_MOUSE:	 evcode = BTN_RIGHT; break;
+		case KEYD_MOUSE_1:	 evcode = BTN_SIDE; break;
+		case KEYD_MOUSE_2:	 evcode = BTN_EXTRA; break;
+		case KEYD_MOUSE_BACK:	 evcode = BTN_BACK; break;
+		case KEYD_MOUSE_FORWARD: evcode = BTN_FORWARD; break;
+		case KEYD_ZOOM:		 evcode = KEY_ZOOM; is_btn = 0; break;
+		case KEYD_VOICECOMMAND: evcode = KEY_VOICECOMMAND; is_btn = 0; break;
 		default:
-			ev.code = code;
+			evcode = code;
 			is_btn = 0;
 			break;
 	}
@@ -180,37 +323,20 @@ static void write_key_event(const struct vkbd *vkbd, uint8_t code, int state)
 	 * to prevent X from identifying the virtual
 	 * keyboard as a mouse.
 	 */
-	if (is_btn) {
+	if (is_btn)
 		fd = vkbd->pfd;
 
-		/*
-		 * Give key events preceding a mouse click
-		 * a chance to propagate to avoid event
-		 * order transposition. A bit kludegy,
-		 * but better than waiting for all events
-		 * to propagate and then checking them
-		 * on re-entry.
-		 *
-		 * TODO: fixme (maybe)
-		 */
-		usleep(1000);
-	}
-
-	ev.value = state;
-
-	ev.time.tv_sec = 0;
-	ev.time.tv_usec = 0;
-
-	xwrite(fd, &ev, sizeof(ev));
-
-	ev.type = EV_SYN;
-	ev.code = 0;
-	ev.value = 0;
+	open_frame(fd);
 
+	if (queue.frame_keys[evcode / 8] & (1 << (evcode % 8))) {
+		close_frame();
+		open_frame(fd);
+	}
 
-	xwrite(fd, &ev, sizeof(ev));
+	queue.frame_keys[evcode / 8] |= 1 << (evcode % 8);
+	queue_event(fd, EV_KEY, evcode, state);
 
-	pthread_mutex_unlock(&mtx);
+	commit();
 }
 
 struct vkbd *vkbd_init(const char *name)
@@ -221,102 +347,73 @@ struct vkbd *vkbd_init(const char *name)
 	vkbd->fd = create_virtual_keyboard(name);
 	vkbd->pfd = create_virtual_pointer("keyd virtual pointer");
 
+	queue.kbd_fd = vkbd->fd;
+
 	return vkbd;
 }
 
-void vkbd_mouse_move(const struct vkbd *vkbd, int x, int y)
+void vkbd_begin(const struct vkbd *vkbd)
 {
-	struct input_event ev;
+	(void)vkbd;
 
-	if (x) {
-		ev.type = EV_REL;
-		ev.code = REL_X;
-		ev.value = x;
+	queue.batch = 1;
+}
 
-		ev.time.tv_sec = 0;
-		ev.time.tv_usec = 0;
+int vkbd_flush(const struct vkbd *vkbd)
+{
+	long wait;
 
-		xwrite(vkbd->pfd, &ev, sizeof(ev));
-	}
+	(void)vkbd;
 
-	if (y) {
-		ev.type = EV_REL;
-		ev.code = REL_Y;
-		ev.value = y;
+	queue.batch = 0;
 
-		ev.time.tv_sec = 0;
-		ev.time.tv_usec = 0;
+	close_frame();
+	wait = flush_queue(0);
 
-		xwrite(vkbd->pfd, &ev, sizeof(ev));
-	}
+	/* Preserve ordering by queueing subsequent output behind held events. */
+	if (wait)
+		queue.batch = 1;
 
-	ev.type = EV_SYN;
-	ev.code = 0;
-	ev.value = 0;
-
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+	return wait;
 }
 
-void vkbd_mouse_scroll(const struct vkbd *vkbd, int x, int y)
+void vkbd_mouse_move(const struct vkbd *vkbd, int x, int y)
 {
-	struct input_event ev;
-
-	ev.type = EV_REL;
-	ev.code = REL_WHEEL;
-	ev.value = y;
-
-	ev.time.tv_sec = 0;
-	ev.time.tv_usec = 0;
+	open_frame(vkbd->pfd);
 
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+	if (x)
+		queue_event(vkbd->pfd, EV_REL, REL_X, x);
 
-	ev.type = EV_REL;
-	ev.code = REL_HWHEEL;
-	ev.value = x;
+	if (y)
+		queue_event(vkbd->pfd, EV_REL, REL_Y, y);
 
-	ev.time.tv_sec = 0;
-	ev.time.tv_usec = 0;
+	close_frame();
+	commit();
+}
 
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+void vkbd_mouse_scroll(const struct vkbd *vkbd, int x, int y)
+{
+	open_frame(vkbd->pfd);
 
-	ev.type = EV_SYN;
-	ev.code = 0;
-	ev.value = 0;
+	queue_event(vkbd->pfd, EV_REL, REL_WHEEL, y);
+	queue_event(vkbd->pfd, EV_REL, REL_HWHEEL, x);
 
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+	close_frame();
+	commit();
 }
 
 void vkbd_mouse_move_abs(const struct vkbd *vkbd, int x, int y)
 {
-	struct input_event ev;
-
-	if (x) {
-		ev.type = EV_ABS;
-		ev.code = ABS_X;
-		ev.value = x;
-
-		ev.time.tv_sec = 0;
-		ev.time.tv_usec = 0;
+	open_frame(vkbd->pfd);
 
-		xwrite(vkbd->pfd, &ev, sizeof(ev));
-	}
-
-	if (y) {
-		ev.type = EV_ABS;
-		ev.code = ABS_Y;
-		ev.value = y;
-
-		ev.time.tv_sec = 0;
-		ev.time.tv_usec = 0;
-
-		xwrite(vkbd->pfd, &ev, sizeof(ev));
-	}
+	if (x)
+		queue_event(vkbd->pfd, EV_ABS, ABS_X, x);
 
-	ev.type = EV_SYN;
-	ev.code = 0;
-	ev.value = 0;
+	if (y)
+		queue_event(vkbd->pfd, EV_ABS, ABS_Y, y);
 
-	xwrite(vkbd->pfd, &ev, sizeof(ev));
+	close_frame();
+	commit();
 }
 
 void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
@@ -329,6 +426,8 @@ void vkbd_send_key(const struct vkbd *vkbd, uint8_t code, int state)
 void free_vkbd(struct vkbd *vkbd)
 {
 	if (vkbd) {
+		close_frame();
+		flush_queue(1);
 		close(vkbd->fd);
 		free(vkbd);
 	}
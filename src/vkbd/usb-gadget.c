@@ -134,6 +134,15 @@ struct vkbd *vkbd_init(const char *name)
 	return vkbd;
 }
 
+void vkbd_begin(const struct vkbd *vkbd)
+{
+}
+
+int vkbd_flush(const struct vkbd *vkbd)
+{
+	return 0;
+}
+
 void vkbd_mouse_move(const struct vkbd *vkbd, int x, int y)
 {
 	fprintf(stderr, "usb-gadget: mouse support is not implemented\n");
@@ -0,0 +1,322 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+
+#include "keyd.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+/*
+ * A worker processes its input while holding its lock, which the event loop
+ * takes to access the keyboard (e.g. to apply bindings). Neither side ever
+ * blocks on a full queue: the event loop drains the worker's output while
+ * waiting, and a worker waiting for output space is guaranteed to be
+ * drained since the event loop is signalled first.
+ *
+ * Output queued by a worker may refer to its config, so the output of a
+ * worker is always drained before the event loop modifies its keyboard.
+ */
+
+#define QUEUE_SIZE 1024
+
+struct queue {
+	_Atomic size_t head;
+	_Atomic size_t tail;
+
+	size_t elemsz;
+	char *buf;
+};
+
+struct worker {
+	pthread_t tid;
+	pthread_mutex_t lock;
+
+	struct keyboard *kbd;
+	worker_fn fn;
+
+	/* Signalled when input is queued or the worker should exit. */
+	int fd;
+	/* Armed with the keyboard deadline. */
+	int timerfd;
+	atomic_int stop;
+	atomic_int done;
+
+	int64_t time;
+	int64_t deadline;
+	int notify;
+
+	struct queue input;
+	struct queue output;
+};
+
+static int outfd = -1;
+static void (*output_handler)(const struct worker_output *out);
+
+static _Thread_local struct worker *self;
+
+static void queue_init(struct queue *q, size_t elemsz)
+{
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+
+	q->elemsz = elemsz;
+	q->buf = malloc(QUEUE_SIZE * elemsz);
+}
+
+static int queue_push(struct queue *q, const void *elem)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if (head - tail == QUEUE_SIZE)
+		return -1;
+
+	memcpy(q->buf + (head % QUEUE_SIZE) * q->elemsz, elem, q->elemsz);
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	return 0;
+}
+
+static int queue_pop(struct queue *q, void *elem)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	if (head == tail)
+		return -1;
+
+	memcpy(elem, q->buf + (tail % QUEUE_SIZE) * q->elemsz, q->elemsz);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+	return 0;
+}
+
+static void signal_fd(int fd)
+{
+	uint64_t v = 1;
+
+	if (write(fd, &v, sizeof v) < 0) {}
+}
+
+static void process_input(struct worker *w)
+{
+	struct device_event devevs[MAX_DEVICE_EVENTS];
+
+	while (1) {
+		size_t n = 0;
+		int64_t timeout;
+
+		while (n < MAX_DEVICE_EVENTS && !queue_pop(&w->input, &devevs[n]))
+			n++;
+
+		if (!n)
+			return;
+
+		timeout = w->fn(w->kbd, devevs, n, &w->time);
+		if (timeout != -1)
+			w->deadline = timeout ? w->time + timeout : 0;
+	}
+}
+
+static void process_timeout(struct worker *w)
+{
+	int64_t now = get_time_us();
+	struct key_event kev = {0};
+	int64_t timeout;
+
+	if (!w->deadline || now < w->deadline)
+		return;
+
+	if (now > w->time)
+		w->time = now;
+
+	kev.code = 0;
+	kev.timestamp = w->time;
+
+	timeout = kbd_process_events(w->kbd, &kev, 1);
+	w->deadline = timeout ? w->time + timeout : 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	self = w;
+
+	while (1) {
+		struct pollfd pfds[] = {
+			{ .fd = w->fd, .events = POLLIN },
+			{ .fd = w->timerfd, .events = POLLIN },
+		};
+		struct itimerspec its = {0};
+		int64_t deadline = w->deadline;
+		uint64_t v;
+		int stop;
+
+		if (poll(pfds, ARRAY_SIZE(pfds), -1) < 0 && errno != EINTR)
+			die("poll: %s", strerror(errno));
+
+		if (read(w->fd, &v, sizeof v) < 0) {}
+		if (read(w->timerfd, &v, sizeof v) < 0) {}
+
+		/* Input queued before the request to stop is still processed. */
+		stop = atomic_load(&w->stop);
+
+		pthread_mutex_lock(&w->lock);
+
+		/* Input which arrived alongside the timeout may preempt it. */
+		process_input(w);
+		process_timeout(w);
+
+		pthread_mutex_unlock(&w->lock);
+
+		if (w->deadline != deadline) {
+			its.it_value.tv_sec = w->deadline / 1000000;
+			its.it_value.tv_nsec = (w->deadline % 1000000) * 1000;
+
+			timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+		}
+
+		if (w->notify) {
+			w->notify = 0;
+			signal_fd(outfd);
+		}
+
+		if (stop)
+			break;
+	}
+
+	atomic_store(&w->done, 1);
+	return NULL;
+}
+
+int worker_init(void (*output)(const struct worker_output *out))
+{
+	output_handler = output;
+
+	outfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (outfd < 0) {
+		perror("eventfd");
+		exit(-1);
+	}
+
+	return outfd;
+}
+
+struct worker *worker_start(struct keyboard *kbd, worker_fn fn)
+{
+	struct worker *w = calloc(1, sizeof(struct worker));
+	sigset_t set, old;
+	int ret;
+
+	w->kbd = kbd;
+	w->fn = fn;
+
+	w->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (w->fd < 0 || w->timerfd < 0) {
+		perror("worker");
+		exit(-1);
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	atomic_init(&w->stop, 0);
+	atomic_init(&w->done, 0);
+
+	queue_init(&w->input, sizeof(struct device_event));
+	queue_init(&w->output, sizeof(struct worker_output));
+
+	/* Signals are left to the event loop. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	ret = pthread_create(&w->tid, NULL, worker_main, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		keyd_log("r{ERROR:} failed to create worker: %s\n", strerror(ret));
+		exit(-1);
+	}
+
+	return w;
+}
+
+/* Processes any remaining input and performs the resulting output before freeing the worker. */
+void worker_stop(struct worker *w)
+{
+	atomic_store(&w->stop, 1);
+	signal_fd(w->fd);
+
+	while (!atomic_load(&w->done)) {
+		worker_drain(w);
+		sched_yield();
+	}
+
+	pthread_join(w->tid, NULL);
+	worker_drain(w);
+
+	pthread_mutex_destroy(&w->lock);
+	close(w->fd);
+	close(w->timerfd);
+
+	free(w->input.buf);
+	free(w->output.buf);
+	free(w);
+}
+
+void worker_queue(struct worker *w, const struct device_event *devevs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		while (queue_push(&w->input, &devevs[i])) {
+			signal_fd(w->fd);
+			worker_drain(w);
+			sched_yield();
+		}
+	}
+
+	signal_fd(w->fd);
+}
+
+void worker_drain(struct worker *w)
+{
+	struct worker_output out;
+
+	while (!queue_pop(&w->output, &out))
+		output_handler(&out);
+}
+
+void worker_lock(struct worker *w)
+{
+	while (pthread_mutex_trylock(&w->lock)) {
+		worker_drain(w);
+		sched_yield();
+	}
+
+	/* Output queued before the lock was acquired. */
+	worker_drain(w);
+}
+
+void worker_unlock(struct worker *w)
+{
+	pthread_mutex_unlock(&w->lock);
+}
+
+int worker_emit(const struct worker_output *out)
+{
+	if (!self)
+		return 0;
+
+	while (queue_push(&self->output, out)) {
+		signal_fd(outfd);
+		sched_yield();
+	}
+
+	self->notify = 1;
+	return 1;
+}
@@ -0,0 +1,80 @@
+/*
+ * keyd - A key remapping daemon.
+ *
+ * © 2019 Raheman Vaiya (see also: LICENSE).
+ */
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Optional per-keyboard threads. Each worker owns a keyboard and runs its
+ * state machine (including its timeouts) on a thread of its own, fed with
+ * device events by the event loop through a lock-free single producer,
+ * single consumer queue.
+ *
+ * Output generated on a worker is not performed directly, but queued (in
+ * the same fashion) for the event loop, which performs the output of all
+ * workers and thereby serializes access to the vkbd, listeners and the
+ * command runner.
+ */
+
+struct keyboard;
+struct device_event;
+
+struct worker_output {
+	enum {
+		OUTPUT_KEY,
+		OUTPUT_LAYER,
+		OUTPUT_COMMAND,
+		OUTPUT_MOUSE_MOVE,
+		OUTPUT_MOUSE_MOVE_ABS,
+		OUTPUT_MOUSE_SCROLL,
+	} type;
+
+	uint8_t code;
+	uint8_t state;
+	int x;
+	int y;
+
+	const struct keyboard *kbd;
+	/* The layer name or command, owned by the keyboard's config. */
+	const char *name;
+};
+
+struct worker;
+
+/*
+ * Passes a batch of device events to the keyboard and returns the keyboard
+ * timeout (or -1 if the keyboard was not invoked). time holds the time last
+ * seen by the keyboard, which must never run backwards.
+ */
+typedef int64_t (*worker_fn)(struct keyboard *kbd,
+			     const struct device_event *devevs, size_t n,
+			     int64_t *time);
+
+/*
+ * Returns a descriptor which becomes readable when output is pending, at
+ * which point worker_drain() should be called for each worker.
+ */
+int worker_init(void (*output)(const struct worker_output *out));
+
+struct worker *worker_start(struct keyboard *kbd, worker_fn fn);
+void worker_stop(struct worker *w);
+
+void worker_queue(struct worker *w, const struct device_event *devevs, size_t n);
+void worker_drain(struct worker *w);
+
+/* Grants the calling (event loop) thread exclusive access to the keyboard. */
+void worker_lock(struct worker *w);
+void worker_unlock(struct worker *w);
+
+/*
+ * Queues the given output if called from a worker and returns 1, otherwise
+ * returns 0 and the output should be performed by the caller.
+ */
+int worker_emit(const struct worker_output *out);
+
+#endif
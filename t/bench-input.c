@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/keyd.h"
+
+/*
+ * Measures the rate at which text can be translated into key events by the
+ * injection path used by `keyd input`. Output is discarded, so this
+ * represents an upper bound on the achievable throughput.
+ */
+
+#define TEXT_SIZE (1 << 20)
+
+static size_t nevents = 0;
+
+static void send_key(uint8_t code, uint8_t pressed)
+{
+	nevents++;
+}
+
+static double get_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+static size_t fill(char *buf, size_t sz, const char *sample)
+{
+	size_t n = 0;
+	size_t len = strlen(sample);
+
+	while (n + len < sz) {
+		memcpy(buf + n, sample, len);
+		n += len;
+	}
+
+	return n;
+}
+
+static void run(const char *name, const char *sample)
+{
+	static char buf[TEXT_SIZE];
+	struct input_state state = {0};
+	size_t sz = fill(buf, sizeof buf, sample);
+	size_t pos = 0;
+	size_t nchars = 0;
+	double start;
+	double elapsed;
+
+	nevents = 0;
+	start = get_time();
+
+	while (pos < sz) {
+		int n = input_char(&state, buf + pos, sz - pos, send_key);
+
+		if (n <= 0) {
+			fprintf(stderr, "%s: %s\n", name, errstr);
+			exit(-1);
+		}
+
+		pos += n;
+		nchars++;
+	}
+
+	input_release(&state, send_key);
+	elapsed = get_time() - start;
+
+	printf("%-10s %10.0f chars/s %6.2f events/char\n",
+	       name, nchars / elapsed, (double)nevents / nchars);
+}
+
+int main(int argc, char *argv[])
+{
+	run("ascii", "The quick brown fox jumps over the lazy dog.\n");
+	run("shifted", "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG!\n");
+	run("unicode", "Größenwahn \xe2\x98\xba naïve café \xe2\x82\xac \xe2\x86\x92\n");
+
+	return 0;
+}
@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../src/keyd.h"
+
+/*
+ * Replays a stream of key events through kbd_process_events() for each of the
+ * supplied configs and reports the throughput, the distribution of the time
+ * taken to process individual events and the number of heap allocations
+ * made along the way. Timeouts are delivered the same way the daemon
+ * delivers them, so the results are deterministic for a given stream.
+ *
+ * The stream is either synthetic (a reproducible mixture of typing, rollover,
+ * modifier chords and held keys) or read from a recording. Recordings may be
+ * in the format produced by `keyd monitor -t` or the input section of a .t
+ * file, and are looped until the requested number of events is reached.
+ *
+ * Allocations are counted by wrapping malloc() and friends at link time (see
+ * the bench target in the Makefile).
+ */
+
+#define DEFAULT_EVENTS 2000000
+#define DEFAULT_THRESHOLD 10
+
+struct result {
+	char name[256];
+	double rate;
+};
+
+static size_t nallocs;
+static int counting;
+
+static size_t noutput;
+
+void *__real_malloc(size_t sz);
+void *__real_calloc(size_t n, size_t sz);
+void *__real_realloc(void *ptr, size_t sz);
+
+void *__wrap_malloc(size_t sz)
+{
+	nallocs += counting;
+	return __real_malloc(sz);
+}
+
+void *__wrap_calloc(size_t n, size_t sz)
+{
+	nallocs += counting;
+	return __real_calloc(n, sz);
+}
+
+void *__wrap_realloc(void *ptr, size_t sz)
+{
+	nallocs += counting;
+	return __real_realloc(ptr, sz);
+}
+
+static void send_key(uint8_t code, uint8_t pressed)
+{
+	noutput++;
+}
+
+static void on_layer_change(const struct keyboard *kbd, const char *name, uint8_t active)
+{
+}
+
+static void run_command(const char *cmd)
+{
+}
+
+static int64_t get_time_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint32_t rng_state = 0x6b657964;
+
+/* xorshift32, so synthetic streams are identical across runs and platforms. */
+static uint32_t rng(uint32_t n)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+
+	return rng_state % n;
+}
+
+static struct key_event *events;
+static size_t nr_events;
+static size_t max_events;
+
+static void push(uint8_t code, uint8_t pressed, int64_t timestamp)
+{
+	if (nr_events == max_events) {
+		max_events = max_events ? max_events * 2 : 4096;
+		events = realloc(events, max_events * sizeof(struct key_event));
+	}
+
+	events[nr_events].code = code;
+	events[nr_events].pressed = pressed;
+	events[nr_events].timestamp = timestamp;
+	nr_events++;
+}
+
+static void generate(size_t n)
+{
+	static const uint8_t keys[] = {
+		KEYD_A, KEYD_B, KEYD_C, KEYD_D, KEYD_E, KEYD_F, KEYD_G, KEYD_H,
+		KEYD_I, KEYD_J, KEYD_K, KEYD_L, KEYD_M, KEYD_N, KEYD_O, KEYD_P,
+		KEYD_Q, KEYD_R, KEYD_S, KEYD_T, KEYD_U, KEYD_V, KEYD_W, KEYD_X,
+		KEYD_Y, KEYD_Z, KEYD_1, KEYD_2, KEYD_3, KEYD_4, KEYD_5, KEYD_6,
+		KEYD_7, KEYD_8, KEYD_9, KEYD_0, KEYD_SPACE, KEYD_SPACE, KEYD_SPACE,
+		KEYD_DOT, KEYD_COMMA, KEYD_ENTER, KEYD_BACKSPACE, KEYD_SEMICOLON,
+	};
+
+	static const uint8_t mods[] = {
+		KEYD_LEFTSHIFT, KEYD_LEFTSHIFT, KEYD_LEFTCTRL, KEYD_LEFTALT,
+		KEYD_LEFTMETA, KEYD_RIGHTALT, KEYD_CAPSLOCK, KEYD_ESC,
+	};
+
+	int64_t time = 0;
+
+	while (nr_events < n) {
+		uint8_t key = keys[rng(ARRAY_SIZE(keys))];
+		uint32_t r = rng(100);
+
+		if (r < 10) {
+			/* Modifier chord. */
+			uint8_t mod = mods[rng(ARRAY_SIZE(mods))];
+
+			push(mod, 1, time * 1000);
+			time += 40 + rng(80);
+			push(key, 1, time * 1000);
+			time += 30 + rng(60);
+			push(key, 0, time * 1000);
+			time += 20 + rng(60);
+			push(mod, 0, time * 1000);
+		} else if (r < 13) {
+			/* Modifier held past any overload timeout, then tapped. */
+			uint8_t mod = mods[rng(ARRAY_SIZE(mods))];
+
+			push(mod, 1, time * 1000);
+			time += 200 + rng(400);
+			push(mod, 0, time * 1000);
+		} else if (r < 30) {
+			/* Rollover. */
+			uint8_t next = keys[rng(ARRAY_SIZE(keys))];
+
+			if (next == key)
+				next = KEYD_SPACE == key ? KEYD_E : KEYD_SPACE;
+
+			push(key, 1, time * 1000);
+			time += 20 + rng(40);
+			push(next, 1, time * 1000);
+			time += 10 + rng(40);
+			push(key, 0, time * 1000);
+			time += 20 + rng(40);
+			push(next, 0, time * 1000);
+		} else {
+			push(key, 1, time * 1000);
+			time += 30 + rng(60);
+			push(key, 0, time * 1000);
+		}
+
+		time += 30 + rng(150);
+	}
+}
+
+static uint8_t lookup_code(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(keycode_table); i++)
+		if (keycode_table[i].name && !strcmp(keycode_table[i].name, name))
+			return i;
+
+	return 0;
+}
+
+static void load_recording(const char *path)
+{
+	char line[1024];
+	int64_t time = 0;
+	int ln = 0;
+	FILE *fh = fopen(path, "r");
+
+	if (!fh) {
+		perror(path);
+		exit(-1);
+	}
+
+	while (fgets(line, sizeof line, fh)) {
+		char *toks[8];
+		size_t n = 0;
+		char *tok;
+
+		ln++;
+
+		if (line[0] == '#')
+			continue;
+
+		for (tok = strtok(line, " \t\n"); tok && n < ARRAY_SIZE(toks); tok = strtok(NULL, " \t\n"))
+			toks[n++] = tok;
+
+		if (!n) {
+			/* The expected output of a .t file follows the first blank line. */
+			if (nr_events)
+				break;
+
+			continue;
+		}
+
+		if (toks[0][0] == '+') {
+			/* keyd monitor -t: "+<n> ms <device> <id> <key> <state>" */
+			time += atoi(toks[0] + 1);
+		} else if (n == 1 && strstr(toks[0], "ms")) {
+			time += atoi(toks[0]);
+			continue;
+		}
+
+		if (n >= 2 && (!strcmp(toks[n-1], "down") || !strcmp(toks[n-1], "up"))) {
+			uint8_t code = lookup_code(toks[n-2]);
+
+			if (!code) {
+				fprintf(stderr, "%s:%d: %s is not a valid key\n", path, ln, toks[n-2]);
+				exit(-1);
+			}
+
+			push(code, !strcmp(toks[n-1], "down"), time * 1000);
+		}
+	}
+
+	fclose(fh);
+
+	if (!nr_events) {
+		fprintf(stderr, "%s: no events found\n", path);
+		exit(-1);
+	}
+}
+
+/* Repeats the recording until it contains n events, preserving relative timing. */
+static void loop_recording(size_t n)
+{
+	size_t len = nr_events;
+	int64_t span = events[len-1].timestamp - events[0].timestamp + 1000000;
+	size_t i;
+
+	for (i = 0; nr_events < n; i++) {
+		const struct key_event *ev = &events[i % len];
+
+		push(ev->code, ev->pressed, ev->timestamp + span * (int64_t)(i / len + 1));
+	}
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Returns -1 if the config could not be parsed. */
+static int run(const char *path, uint32_t *latencies, struct result *result)
+{
+	struct output output = {
+		.send_key = send_key,
+		.on_layer_change = on_layer_change,
+		.run_command = run_command,
+	};
+
+	struct config *config = malloc(sizeof(struct config));
+	struct keyboard *kbd;
+	const char *name;
+	int64_t deadline = 0;
+	int64_t total = 0;
+	size_t i;
+
+	if (config_parse(config, path)) {
+		fprintf(stderr, "failed to parse %s: %s\n", path, errstr);
+		free(config);
+		return -1;
+	}
+
+	kbd = new_keyboard(config, &output);
+
+	noutput = 0;
+	nallocs = 0;
+	counting = 1;
+
+	i = 0;
+	while (i < nr_events) {
+		int64_t start;
+		int64_t timeout;
+
+		/* Deliver any timeout which expires first, as the daemon would. */
+		if (deadline && deadline <= events[i].timestamp) {
+			struct key_event kev = { .code = 0, .timestamp = deadline };
+
+			start = get_time_ns();
+			timeout = kbd_process_events(kbd, &kev, 1);
+			total += get_time_ns() - start;
+
+			deadline = timeout ? deadline + timeout : 0;
+			continue;
+		}
+
+		start = get_time_ns();
+		timeout = kbd_process_events(kbd, &events[i], 1);
+		latencies[i] = get_time_ns() - start;
+		total += latencies[i];
+
+		deadline = timeout ? events[i].timestamp + timeout : 0;
+		i++;
+	}
+
+	counting = 0;
+
+	qsort(latencies, nr_events, sizeof(uint32_t), cmp_u32);
+
+	name = strrchr(path, '/');
+	snprintf(result->name, sizeof result->name, "%s", name ? name + 1 : path);
+	result->rate = nr_events / (total / 1E9);
+
+	printf("%-32s %12.0f %8u %8u %8u %8u %8u %10.3f %8.2f\n",
+	       result->name,
+	       result->rate,
+	       latencies[nr_events / 2],
+	       latencies[nr_events * 90 / 100],
+	       latencies[nr_events * 99 / 100],
+	       latencies[nr_events * 999 / 1000],
+	       latencies[nr_events - 1],
+	       (double)nallocs / nr_events,
+	       (double)noutput / nr_events);
+
+	free_keyboard(kbd);
+	free(config);
+
+	return 0;
+}
+
+/*
+ * Compares the results against a previous run (i.e the saved output of this
+ * program) and returns the number of configs whose throughput has dropped
+ * by more than the given percentage.
+ */
+static int compare(const char *path, struct result *results, size_t n, int threshold)
+{
+	char line[1024];
+	int regressions = 0;
+	FILE *fh = fopen(path, "r");
+
+	if (!fh) {
+		perror(path);
+		exit(-1);
+	}
+
+	while (fgets(line, sizeof line, fh)) {
+		char name[256];
+		double rate;
+		size_t i;
+
+		if (sscanf(line, "%255s %lf", name, &rate) != 2)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			double change = (results[i].rate - rate) / rate * 100;
+
+			if (strcmp(results[i].name, name))
+				continue;
+
+			if (change < -threshold) {
+				printf("REGRESSION: %s %.1f%% (%.0f -> %.0f events/s)\n",
+				       name, change, rate, results[i].rate);
+				regressions++;
+			}
+		}
+	}
+
+	fclose(fh);
+	return regressions;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n <events>] [-r <recording>] [-c <baseline>] [-t <percent>] <config> [<config>...]\n\n"
+		"\t-n: The number of events to replay (default: %d).\n"
+		"\t-r: Replay the given recording instead of synthetic input.\n"
+		"\t-c: Fail if throughput has dropped relative to the saved output of a previous run.\n"
+		"\t-t: The tolerated drop in throughput for -c (default: %d%%).\n",
+		prog, DEFAULT_EVENTS, DEFAULT_THRESHOLD);
+	exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *recording = NULL;
+	const char *baseline = NULL;
+	int threshold = DEFAULT_THRESHOLD;
+	size_t n = DEFAULT_EVENTS;
+	struct result *results;
+	uint32_t *latencies;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "n:r:c:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			n = atol(optarg);
+			break;
+		case 'r':
+			recording = optarg;
+			break;
+		case 'c':
+			baseline = optarg;
+			break;
+		case 't':
+			threshold = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc || !n)
+		usage(argv[0]);
+
+	if (recording) {
+		load_recording(recording);
+		loop_recording(n);
+	} else {
+		generate(n);
+	}
+
+	latencies = malloc(nr_events * sizeof(uint32_t));
+	results = calloc(argc - optind, sizeof(struct result));
+
+	printf("# %zu events (%s)\n", nr_events, recording ? recording : "synthetic");
+	printf("# %-30s %12s %8s %8s %8s %8s %8s %10s %8s\n",
+	       "config", "events/s", "p50/ns", "p90/ns", "p99/ns", "p99.9/ns", "max/ns", "allocs/ev", "out/ev");
+
+	/* Configs which fail to parse are skipped so one bad file does not abort the matrix. */
+	for (i = optind; i < argc; i++)
+		run(argv[i], latencies, &results[i - optind]);
+
+	if (baseline && compare(baseline, results, argc - optind, threshold))
+		return 1;
+
+	return 0;
+}
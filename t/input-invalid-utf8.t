@@ -0,0 +1,4 @@
+input a\x80b
+
+a down
+a up
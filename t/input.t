@@ -0,0 +1,8 @@
+input aB
+
+a down
+a up
+leftshift down
+b down
+b up
+leftshift up
@@ -0,0 +1,12 @@
+y down
+y up
+20ms
+x down
+x up
+
+a down
+a up
+b down
+b up
+x down
+x up
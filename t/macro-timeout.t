@@ -0,0 +1,17 @@
+y down
+y up
+5ms
+x down
+x up
+10ms
+v down
+v up
+
+a down
+a up
+b down
+b up
+x down
+x up
+v down
+v up
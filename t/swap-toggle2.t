@@ -0,0 +1,15 @@
+4 down
+4 up
+s down
+s up
+4 down
+4 up
+s down
+s up
+x down
+x up
+s down
+s up
+
+shift down
+shift up
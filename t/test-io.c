@@ -7,6 +7,10 @@
 struct key_event output[MAX_EVENTS];
 size_t noutput = 0;
 
+/* Text supplied by an "input <text>" line, typed as keyd input would. */
+static char input_text[256];
+static size_t input_text_sz = 0;
+
 static uint8_t lookup_code(const char *name)
 {
 	size_t i;
@@ -33,6 +37,41 @@ static void send_key(uint8_t code, uint8_t pressed)
 	noutput++;
 }
 
+/* Copies s into input_text, decoding \xNN escapes. */
+static void parse_input_text(const char *s)
+{
+	input_text_sz = 0;
+
+	while (*s && input_text_sz < sizeof input_text) {
+		unsigned int c;
+
+		if (s[0] == '\\' && s[1] == 'x' && sscanf(s + 2, "%2x", &c) == 1) {
+			input_text[input_text_sz++] = c;
+			s += 4;
+		} else {
+			input_text[input_text_sz++] = *s++;
+		}
+	}
+}
+
+/* Stops at the first character which cannot be typed, like the daemon. */
+static void type_text(const char *s, size_t sz)
+{
+	struct input_state state = {0};
+	size_t pos = 0;
+
+	while (pos < sz) {
+		int n = input_char(&state, s + pos, sz - pos, send_key);
+
+		if (n <= 0)
+			break;
+
+		pos += n;
+	}
+
+	input_release(&state, send_key);
+}
+
 static char *read_file(const char *path)
 {
 	int fd = open(path, O_RDONLY);
@@ -123,7 +162,7 @@ static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
 			struct key_event out[MAX_EVENTS], size_t *nout)
 {
 	int ret;
-	int time = 0;
+	int64_t time = 0;
 	int ln = 0;
 	int n = 0;
 	struct key_event *events = in;
@@ -131,6 +170,7 @@ static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
 	char *line = s;
 	*nin = 0;
 	*nout = 0;
+	input_text_sz = 0;
 
 	while (1) {
 		int len;
@@ -158,8 +198,10 @@ static int parse_events(char *s, struct key_event in[MAX_EVENTS], size_t *nin,
 			goto next;
 		}
 
-		if (len >= 2 && line[len - 1] == 's' && line[len - 2] == 'm') {
-			time += atoi(line);
+		if (!strncmp(line, "input ", 6)) {
+			parse_input_text(line + 6);
+		} else if (len >= 2 && line[len - 1] == 's' && line[len - 2] == 'm') {
+			time += atoi(line) * 1000LL;
 		} else {
 			uint8_t code;
 			char *k = strtok(line, " ");
@@ -207,6 +249,8 @@ void run_test(struct keyboard *kbd, const char *path)
 	}
 
 	noutput = 0;
+
+	type_text(input_text, input_text_sz);
 	kbd_process_events(kbd, input, ninput);
 
 	if (cmp_events(output, noutput, expected, nexpected)) {
@@ -222,6 +266,10 @@ static void on_layer_change(const struct keyboard *kbd, const char *name, uint8_
 {
 }
 
+static void run_command(const char *cmd)
+{
+}
+
 int main(int argc, char *argv[])
 {
 	size_t i;
@@ -231,6 +279,7 @@ int main(int argc, char *argv[])
 	struct output output = {
 		.send_key = send_key,
 		.on_layer_change = on_layer_change,
+		.run_command = run_command,
 	};
 
 	if (argc < 2) {